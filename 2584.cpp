@@ -16,20 +16,27 @@
 #include <fstream>
 #include <cmath>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <memory>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "statistic.h"
+#include "profile.h"
 
 int main(int argc, const char* argv[]) {
     std::cout << "2584-Demo: ";
     std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
     std::cout << std::endl << std::endl;
 
-    size_t total = 1000, block = 0, limit = 0;
-    std::string play_args, evil_args;
-    std::string load, save;
-    bool summary = false;
+    size_t total = 1000, block = 0, limit = 0, threads = 1;
+    std::string play_args, evil_args, base_args;
+    std::string load, save, log;
+    bool summary = false, eval = false, search = false;
     for (int i = 1; i < argc; i++) {
         std::string para(argv[i]);
         if (para.find("--total=") == 0) {
@@ -40,20 +47,35 @@ int main(int argc, const char* argv[]) {
             limit = std::stoull(para.substr(para.find("=") + 1));
         } else if (para.find("--play=") == 0) {
             play_args = para.substr(para.find("=") + 1);
+        } else if (para.find("--baseline=") == 0) {
+            base_args = para.substr(para.find("=") + 1);
         } else if (para.find("--evil=") == 0) {
             evil_args = para.substr(para.find("=") + 1);
         } else if (para.find("--load=") == 0) {
             load = para.substr(para.find("=") + 1);
         } else if (para.find("--save=") == 0) {
             save = para.substr(para.find("=") + 1);
+        } else if (para.find("--log=") == 0) {
+            log = para.substr(para.find("=") + 1);
+        } else if (para.find("--threads=") == 0) {
+            threads = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+        } else if (para.find("--search") == 0) {
+            search = true;
+        } else if (para.find("--eval") == 0) {
+            eval = true;
         } else if (para.find("--summary") == 0) {
             summary = true;
+        } else if (para.find("--profile") == 0) {
+            profile::enable();
         }
     }
 
-    statistic stat(total, block, limit);
+    statistic stat(total, block, limit, save.size());
 
-    if (load.size()) {
+    if (load.size() && journal::detect(load)) {
+        // an episode log resumes the run after its episodes, e.g., with --log=PATH to keep appending to it
+        stat.resume(journal::view(load));
+    } else if (load.size()) {
         std::ifstream in;
         in.open(load.c_str(), std::ios::in | std::ios::binary);
         if (!in.is_open()) return -1;
@@ -61,27 +83,93 @@ int main(int argc, const char* argv[]) {
         in.close();
     }
 
-    player play(play_args);
-    rndenv evil(evil_args);
-
-    while (!stat.is_finished()) {
-        play.open_episode("~:" + evil.name());
-        evil.open_episode(play.name() + ":~");
-
-        stat.open_episode(play.name() + ":" + evil.name());
-        board game = stat.make_empty_board();
-        while (true) {
-            agent& who = stat.take_turns(play, evil);
-            action move = who.take_action(game);
-            if (move.apply(game) == -1) break;
-            stat.save_action(move);
-            if (who.check_for_win(game)) break;
-        }
-        agent& win = stat.last_turns(play, evil);
-        stat.close_episode(win.name());
+    std::unique_ptr<journal> book(log.size() ? new journal(log) : nullptr);
+    if (book) stat.stream(*book);
+
+    // evaluation only: freeze the weights and seed every episode by its index,
+    // so that the same seeds give the same games no matter how many threads run them
+    auto run = [&](statistic& stat, std::string play_args) {
+        if (eval) play_args += " train=0";
+
+        player shared(play_args);
+        std::mutex lock;
+        std::condition_variable progress;
+        size_t claimed = stat.is_finished() ? total : stat.episodes(), merged = claimed;
+        std::map<size_t, statistic> pending;
+
+        // with --eval, episodes are merged into 'stat' in the order they were claimed, so that every block is the same
+        // for any --threads; claims stay within 'ahead' episodes of the merged ones, so that a long episode holds back
+        // at most that many finished ones
+        // otherwise, episodes are merged as they finish
+        const size_t ahead = 4 * threads;
+        auto claim = [&](size_t& n) {
+            std::unique_lock<std::mutex> guard(lock);
+            if (eval) progress.wait(guard, [&]() { return claimed < merged + ahead || claimed >= total; });
+            n = claimed < total ? claimed++ : total;
+            return n < total;
+        };
+        auto finish = [&](size_t n, statistic& local) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!eval) {
+                stat.merge(local);
+                return;
+            }
+            pending.emplace(n, std::move(local));
+            for (auto it = pending.begin(); it != pending.end() && it->first == merged; it = pending.erase(it), merged++)
+                stat.merge(it->second);
+            progress.notify_all();
+        };
+
+        // each thread plays its own episodes with its own environment, and trains the shared weight tables lock-free
+        auto worker = [&](size_t id) {
+            rndenv evil(evil_args + " stream=" + std::to_string(id));
+            std::unique_ptr<player> who_plays(search ? new expectimax(play_args, shared) : new player(play_args, shared));
+            player& play = *who_plays;
+
+            for (size_t n; claim(n); ) {
+                if (eval) evil.reseed(n);
+                statistic local(-1, 0, 0, save.size() || log.size());
+
+                play.open_episode("~:" + evil.name());
+                evil.open_episode(play.name() + ":~");
+
+                local.open_episode(play.name() + ":" + evil.name());
+                board game = local.make_empty_board();
+                while (true) {
+                    agent& who = local.take_turns(play, evil);
+                    action move = who.take_action(game);
+                    int reward = move.apply(game);
+                    if (reward == -1) break;
+                    local.save_action(move, reward);
+                    if (who.check_for_win(game)) break;
+                }
+                agent& win = local.last_turns(play, evil);
+                local.close_episode(win.name(), game);
+
+                play.close_episode(win.name());
+                evil.close_episode(win.name());
+                finish(n, local);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t id = 1; id < threads; id++)
+            workers.emplace_back(worker, id);
+        worker(0);
+        for (std::thread& t : workers)
+            t.join();
+    };
 
-        play.close_episode(win.name());
-        evil.close_episode(win.name());
+    // play the same episodes with a baseline player first, e.g., float tables versus quantized ones with --eval
+    if (base_args.size()) {
+        statistic base(total, block, limit, false);
+        std::cout << "baseline: " << base_args << std::endl << std::endl;
+        run(base, base_args);
+        std::cout << "player: " << play_args << std::endl << std::endl;
+        run(stat, play_args);
+        stat.compare(base);
+    } else {
+        run(stat, play_args);
     }
 
     if (summary) {
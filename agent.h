@@ -2,16 +2,21 @@
 #include <string>
 #include <random>
 #include <sstream>
+#include <fstream>
 #include <map>
 #include <cmath>
 #include <utility>
 #include <type_traits>
 #include <algorithm>
+#include <chrono>
+#include <immintrin.h>
 #include "board.h"
 #include "action.h"
 #include "weight.h"
-
-#define TILENUMBER 24
+#include "region.h"
+#include "codec.h"
+#include "network.h"
+#include "profile.h"
 
 class agent {
 public:
@@ -53,12 +58,28 @@ protected:
  */
 class rndenv : public agent {
 public:
-    rndenv(const std::string& args = "") : agent("name=rndenv " + args) {
+    rndenv(const std::string& args = "") : agent("name=rndenv " + args), base(std::default_random_engine::default_seed) {
         if (property.find("seed") != property.end())
-            engine.seed(int(property["seed"]));
+            base = int(property["seed"]);
+        unsigned seed = base;
+        if (property.find("stream") != property.end())
+            seed += int(property["stream"]); // e.g., the thread index, so that parallel environments differ
+        engine.seed(seed);
+    }
+
+    /**
+     * reseed the engine for the n-th episode, derived from the base seed only
+     * so that the n-th episode plays the same regardless of which thread runs it
+     */
+    void reseed(const size_t& n) {
+        uint64_t z = base + 0x9e3779b97f4a7c15ull * (n + 1); // splitmix64
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        engine.seed(unsigned(z ^ (z >> 31)));
     }
 
     virtual action take_action(const board& after) {
+        profile::scope timing(profile::place);
         int space[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
         std::shuffle(space, space + 16, engine);
         for (int pos : space) {
@@ -72,12 +93,33 @@ public:
 
 private:
     std::default_random_engine engine;
+    unsigned base;
 };
 
-class player : public agent {
+/**
+ * TD learning player over an n-tuple network, see network.h
+ */
+template<typename network>
+class basic_player : public agent {
 public:
-    player(const std::string& args = "") : agent("name=player " + args), alpha(0.0025f), merge(TILENUMBER) {
-        episode.reserve(32768);
+    basic_player(const std::string& args = "") : basic_player(args, nullptr) {}
+
+    /**
+     * a player which trains the weight tables of 'shared' instead of its own
+     * it never loads nor saves weights; that is left to 'shared'
+     */
+    basic_player(const std::string& args, const basic_player& shared) : basic_player(args, &shared) {}
+
+private:
+    basic_player(const std::string& args, const basic_player* shared) : agent("name=player " + args), alpha(0.0025f), merge(TILENUMBER), train(true), online(true) {
+        if (property.find("train") != property.end())
+            train = int(property["train"]);
+        if (property.find("quantize") != property.end() && int(property["quantize"]))
+            train = false; // the float tables are dropped after quantization
+        if (property.find("td") != property.end())
+            online = std::string(property["td"]) != "backward";
+        if (train && !online)
+            episode.reserve(32768);
         if (property.find("seed") != property.end())
             engine.seed(int(property["seed"]));
         if (property.find("alpha") != property.end())
@@ -85,39 +127,91 @@ public:
         if (property.find("merge") != property.end())
             merge = int(property["merge"]);
 
-        if (property.find("load") != property.end())
+        if (shared) {
+            property.erase("save");
+            for (const weight& w : shared->weights)
+                weights.push_back(w.view());
+            qweights = shared->qweights;
+            snapshot = shared->snapshot;
+            init_lanes();
+            return;
+        } else if (property.find("shm") != property.end()) {
+            // shm=NAME: the tables live in shared memory, see region
+            // the process with coordinator=1 creates them (from load=PATH if given) and saves them, the others only train them
+            if (property.count("sparse")) {
+                std::cerr << "sparse tables cannot be shared between processes" << std::endl;
+                std::exit(1);
+            }
+            std::vector<size_t> sizes;
+            for (size_t i = 0; i < network::tables(); i++)
+                sizes.push_back(network::size(i));
+            bool coordinator = property.count("coordinator") && int(property["coordinator"]);
+            if (coordinator)
+                shm = region::create(property["shm"], sizes, property.count("load") ? std::string(property["load"]) : "", description());
+            else
+                shm = region::attach(property["shm"], sizes);
+            if (!coordinator) property.erase("save");
+            weights = shm->tables();
+        } else if (property.find("load") != property.end())
             load_weights(property["load"]);
         else {
-            weights.push_back(weight(SIZE));
-            weights.push_back(weight(SIZE));
-            weights.push_back(weight(SIZE));
-            weights.push_back(weight(SIZE));
+            for (size_t i = 0; i < network::tables(); i++)
+                weights.push_back(sparse(i) ? sparse_table(i) : weight(network::size(i)));
+        }
+
+        bool match = weights.size() == network::tables();
+        for (size_t i = 0; match && i < weights.size(); i++)
+            match = weights[i].size() == network::size(i);
+        if (!match) {
+            std::cerr << "weights do not match the network" << std::endl;
+            std::exit(1);
+        }
+        for (size_t i = 0; i < weights.size(); i++) {
+            if (!sparse(i) || weights[i].sparse()) continue;
+            weight table = sparse_table(i);
+            for (size_t k = 0; k < table.size(); k++) {
+                float v = weights[i].load(k);
+                if (v != 0) table.update(k, v);
+            }
+            weights[i] = std::move(table);
+        }
+
+        if (property.find("quantize") != property.end() && int(property["quantize"])) {
+            for (const weight& w : weights)
+                qweights.push_back(qweight(w));
+            weights.clear();
+            property.erase("save");
         }
+        if (train && property.count("save") && (property.count("every") || property.count("period"))) {
+            size_t every = property.count("every") ? size_t(property["every"]) : 0;
+            double period = property.count("period") ? double(property["period"]) : 0;
+            std::string tuples = description();
+            checkpoint::writer dump = weight::dump;
+            if (!raw()) dump = [tuples](const int& fd, const std::vector<weight>& tables) { return codec::write(fd, tables, tuples); };
+            snapshot = std::make_shared<checkpoint>(property["save"], every, period, dump);
+        }
+        init_lanes();
     }
-    ~player() {
+
+public:
+    ~basic_player() {
+        if (snapshot) snapshot->wait();
+        if (shm) shm->drain();
         if (property.find("save") != property.end())
             save_weights(property["save"]);
     }
 
     virtual void open_episode(const std::string& flag = "") {
+        if (!train) return;
         episode.clear();
-        episode.reserve(32768);
+        if (!online) episode.reserve(32768);
     }
 
     virtual void close_episode(const std::string& flag = "") {
-        for (int i = episode.size()-2; i >= 0; i--) {
-            float delta = alpha * (episode[i+1].reward + episode[i+1].value - episode[i].value);
-            std::array<std::pair<size_t, size_t>, 36> ielist = get_idx_entry_list(episode[i].after);
-            for (std::pair<size_t, size_t> ie : ielist) {
-                if (ie.second >= SIZE) {
-                    std::cout << "index out of bound (maybe achieved unexpected larger tile)" << std::endl;
-                    continue;
-                }
-
-                weights[ie.first][ie.second] += delta;
-                episode[i].value += delta;
-            }
-        }
+        if (!train) return;
+        for (int i = episode.size()-2; !online && i >= 0; i--)
+            learn(episode[i], episode[i+1]);
+        if (snapshot) snapshot->close_episode(weights);
     }
 
     virtual action take_action(const board& before) {
@@ -126,37 +220,71 @@ public:
         s.reward = 0;
         s.value = 0;
 
-        float highest = - INFINITY;
-        int opcode[] = {0, 1, 2, 3};
-        for (int op : opcode) {
-            board b = before;
-            int score = b.move(op);
-            if (score != -1) {
-                float value = get_value(b);
-
-                if (value + score > highest) {
-                    highest = value + score;
-                    best = action::move(op);
-                    s.value = value;
-                    s.after = b;
-                    s.reward = score;
-                    //s.op = op;
+        {
+            profile::scope timing(profile::select);
+            board after[4];
+            int score[4], opcode[4], num = 0;
+            for (int op = 0; op < 4; op++) {
+                after[num] = before;
+                score[num] = after[num].move(op);
+                if (score[num] != -1) opcode[num++] = op;
+            }
+            float value[4];
+            get_values(after, num, value);
+
+            float highest = - INFINITY;
+            for (int i = 0; i < num; i++) {
+                if (value[i] + score[i] > highest) {
+                    highest = value[i] + score[i];
+                    best = action::move(opcode[i]);
+                    s.value = value[i];
+                    s.after = after[i];
+                    s.reward = score[i];
                 }
             }
+            // if can't move, best remain nothing
         }
-        // if can't move, best remain nothing
 
-        episode.push_back(s);
+        if (train && online && episode.size()) {
+            // the previous afterstate is updated as soon as its successor is known, so only that one is kept
+            learn(episode.back(), s);
+            episode.back() = s;
+        } else if (train)
+            episode.push_back(s);
         return best;
     }
 
 public:
     virtual void load_weights(const std::string& path) {
+        if (codec::detect(path)) {
+            // a compressed file is decoded into fresh tables by all cores, see codec
+            weights.clear();
+            codec::read(path, weights, description(), std::thread::hardware_concurrency());
+            return;
+        }
+        if (!property.count("mmap") || int(property["mmap"])) {
+            // map the tables in place, read-only for inference and copy-on-write for training
+            size_t length, offset = sizeof(size_t);
+            std::shared_ptr<char> file = weight::map(path, length, train);
+            size_t size = 0;
+            if (length < offset) {
+                std::cerr << "unexpected end of binary" << std::endl;
+                std::exit(1);
+            }
+            std::memcpy(&size, file.get(), sizeof(size));
+            weights.clear();
+            for (size_t i = 0; i < size; i++)
+                weights.push_back(weight::refer(file, length, offset));
+            return;
+        }
         std::ifstream in;
         in.open(path.c_str(), std::ios::in | std::ios::binary);
         if (!in.is_open()) std::exit(-1);
         size_t size;
-        in.read(reinterpret_cast<char*>(&size), sizeof(size));
+        if (!in.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+            std::cerr << "unexpected end of binary" << std::endl;
+            std::exit(1);
+        }
         weights.resize(size);
         for (weight& w : weights)
             in >> w;
@@ -164,8 +292,17 @@ public:
     }
 
     virtual void save_weights(const std::string& path) {
+        // write aside and rename, so that a mapping of the old file (maybe our own) stays intact
+        std::string temp = path + ".tmp";
+        if (!raw()) {
+            int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool ok = fd != -1 && codec::write(fd, weights, description(), std::thread::hardware_concurrency());
+            ok = fd != -1 && close(fd) == 0 && ok;
+            if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) std::exit(-1);
+            return;
+        }
         std::ofstream out;
-        out.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.open(temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
         if (!out.is_open()) std::exit(-1);
         size_t size = weights.size();
         out.write(reinterpret_cast<char*>(&size), sizeof(size));
@@ -173,155 +310,406 @@ public:
             out << w;
         out.flush();
         out.close();
+        if (!out || std::rename(temp.c_str(), path.c_str()) != 0) std::exit(-1);
     }
 
-private:
+protected:
     float get_value(const board& b) {
-        float value = 0;
-        std::array<std::pair<size_t, size_t>, 36> ielist = get_idx_entry_list(b);
-        for (std::pair<size_t, size_t> ie : ielist) {
-            if (ie.second >= SIZE)
+        float value;
+        get_values(&b, 1, &value);
+        return value;
+    }
+
+    /**
+     * the values of up to 4 boards, e.g., the afterstates of one state
+     * all indices are computed and all weights are prefetched before anything is summed,
+     * so that the random accesses of all boards are outstanding at once instead of stalling one by one
+     */
+    void get_values(const board* b, const int& num, float* value) {
+        if (lanes.size()) {
+            uint32_t index[4][lane_count];
+            for (int i = 0; i < num; i++) {
+                {
+                    profile::scope timing(profile::extract);
+                    get_idx_avx2(b[i], index[i]);
+                }
+                for (size_t f = 0; f < network::features; f++)
+                    weights[layout()[f].table].prefetch(index[i][f]);
+            }
+            for (int i = 0; i < num; i++)
+                value[i] = sum_avx2(index[i]);
+            return;
+        }
+        typename network::feature_list ielist[4];
+        for (int i = 0; i < num; i++) {
+            {
+                profile::scope timing(profile::extract);
+                ielist[i] = get_idx_entry_list(b[i]);
+            }
+            for (std::pair<size_t, size_t> ie : ielist[i])
+                qweights.size() ? qweights[ie.first].prefetch(ie.second) : weights[ie.first].prefetch(ie.second);
+        }
+        for (int i = 0; i < num; i++) {
+            value[i] = 0;
+            if (qweights.size()) {
+                for (std::pair<size_t, size_t> ie : ielist[i])
+                    value[i] += qweights[ie.first][ie.second];
                 continue;
-            value += weights[ie.first][ie.second];
+            }
+            for (std::pair<size_t, size_t> ie : ielist[i])
+                value[i] += weights[ie.first].load(ie.second);
         }
-        return value;
     }
 
-    std::array<std::pair<size_t, size_t>, 36> get_idx_entry_list(const board& b) {
-        std::array<std::pair<size_t, size_t>, 36> ielist;
-        board r = b;
+    /**
+     * gather the (table, index) pairs of all features straight from the board
+     */
+    typename network::feature_list get_idx_entry_list(const board& b) {
+        typename network::feature_list ielist;
+        const int top = std::min(merge, network::tiles - 1);
+        int tile[16], part[16];
+        for (int i = 0; i < 16; i++) {
+            tile[i] = b(i);
+            part[i] = std::min(tile[i], top);
+        }
+        network::collect(tile, part, ielist);
+        return ielist;
+    }
 
-        size_t i = 0;
+private:
+    struct state {
+        board after;
+        float value;
+        int reward;
+    };
 
-        ielist[i++] = std::make_pair(0, get_entry_axe(r(0), r(1), r(2), r(3), r(6), r(7)));
-        ielist[i++] = std::make_pair(1, get_entry_axe(r(4), r(5), r(6), r(7), r(10), r(11)));
-        ielist[i++] = std::make_pair(1, get_entry_axe(r(8), r(9), r(10), r(11), r(14), r(15)));
-        for (int j = 0; j < 3; j++) {
-            r.rotate_right();
-            ielist[i++] = std::make_pair(0, get_entry_axe(r(0), r(1), r(2), r(3), r(6), r(7)));
-            ielist[i++] = std::make_pair(1, get_entry_axe(r(4), r(5), r(6), r(7), r(10), r(11)));
-            ielist[i++] = std::make_pair(1, get_entry_axe(r(8), r(9), r(10), r(11), r(14), r(15)));
+    /**
+     * the TD(0) update of afterstate 's' toward the reward and the value of its successor 'next'
+     */
+    void learn(state& s, const state& next) {
+        profile::scope timing(profile::update);
+        float delta = alpha * (next.reward + next.value - s.value);
+        if (lanes.size()) {
+            // AVX2 has no scatter, so the indices come from the vector kernel and the adds stay scalar
+            uint32_t index[lane_count];
+            get_idx_avx2(s.after, index);
+            for (size_t f = 0; f < network::features; f++) {
+                weights[layout()[f].table].update(index[f], delta);
+                s.value += delta;
+            }
+            return;
         }
-        r.reflect_horizontal();
-        ielist[i++] = std::make_pair(0, get_entry_axe(r(0), r(1), r(2), r(3), r(6), r(7)));
-        ielist[i++] = std::make_pair(1, get_entry_axe(r(4), r(5), r(6), r(7), r(10), r(11)));
-        ielist[i++] = std::make_pair(1, get_entry_axe(r(8), r(9), r(10), r(11), r(14), r(15)));
-        for (int j = 0; j < 3; j++) {
-            r.rotate_right();
-            ielist[i++] = std::make_pair(0, get_entry_axe(r(0), r(1), r(2), r(3), r(6), r(7)));
-            ielist[i++] = std::make_pair(1, get_entry_axe(r(4), r(5), r(6), r(7), r(10), r(11)));
-            ielist[i++] = std::make_pair(1, get_entry_axe(r(8), r(9), r(10), r(11), r(14), r(15)));
+        typename network::feature_list ielist = get_idx_entry_list(s.after);
+        for (std::pair<size_t, size_t> ie : ielist) {
+            weights[ie.first].update(ie.second, delta);
+            s.value += delta;
         }
+    }
+
+    /**
+     * sparse=T,U,...: the listed tables are stored sparsely, see weight
+     * dense=D: the entries whose tiles are all below D stay dense (default 16)
+     * slots=K: the other entries are hashed into 2^K slots per table (default 24)
+     */
+    bool sparse(const size_t& table) {
+        if (!property.count("sparse")) return false;
+        std::stringstream ss(property["sparse"]);
+        for (std::string t; std::getline(ss, t, ','); )
+            if (t.size() && size_t(std::stoul(t)) == table) return true;
+        return false;
+    }
 
-        ielist[i++] = std::make_pair(2, get_entry_six(r(0), r(1), r(4), r(5), r(8), r(9), false));
-        ielist[i++] = std::make_pair(3, get_entry_six(r(1), r(2), r(5), r(6), r(9), r(10), true));
-        ielist[i++] = std::make_pair(2, get_entry_six(r(3), r(2), r(7), r(6), r(11), r(10), false));
-        for (int j = 0; j < 3; j++) {
-            r.rotate_right();
-            ielist[i++] = std::make_pair(2, get_entry_six(r(0), r(1), r(4), r(5), r(8), r(9), false));
-            ielist[i++] = std::make_pair(3, get_entry_six(r(1), r(2), r(5), r(6), r(9), r(10), true));
-            ielist[i++] = std::make_pair(2, get_entry_six(r(3), r(2), r(7), r(6), r(11), r(10), false));
+    weight sparse_table(const size_t& table) {
+        int digits = 0;
+        for (size_t n = 1; n < network::size(table); n *= network::tiles) digits++;
+        int dense = property.count("dense") ? int(property["dense"]) : 16;
+        int slots = property.count("slots") ? int(property["slots"]) : 24;
+        return weight(network::size(table), int(network::tiles), digits, std::min(dense, int(network::tiles)), slots);
+    }
+
+    /**
+     * format=raw (the default) saves the tables as they are in memory, which can be mapped in place (see load_weights);
+     * format=compressed saves a much smaller file which is decoded on load instead, see codec
+     */
+    bool raw() {
+        std::string format = property.count("format") ? std::string(property["format"]) : "raw";
+        if (format != "raw" && format != "compressed") {
+            std::cerr << "unknown weight format " << format << std::endl;
+            std::exit(1);
         }
+        return format == "raw";
+    }
 
-        return ielist;
+    /**
+     * the network as text, recorded by compressed weight files, e.g., "radix 24; table 0: 0 1 2 3 4 5; table 0: 3 2 ..."
+     */
+    static std::string description() {
+        std::stringstream ss;
+        ss << "radix " << network::tiles;
+        for (const feature& f : layout()) {
+            ss << "; table " << f.table << (f.mirror ? " mirror" : "") << ":";
+            for (size_t k = 0; k < f.length; k++)
+                ss << " " << f.cell[k];
+        }
+        return ss.str();
+    }
+
+    /**
+     * the features in groups of 8 vector lanes, for the AVX2 kernels below
+     * padding lanes of the last group repeat cell 0 and are masked off
+     */
+    struct lane {
+        int cell[8][8]; // cell[k][l]: the byte shuffle which moves the k-th cell of the tuple in lane l into that lane
+        int swap[8][8]; // the same with pairs swapped, read instead when a mirror tuple is not canonical
+        int mirror[8]; // -1 for mirror tuples
+        int valid[8]; // -1 for real features, 0 for padding
+        int64_t base[8]; // the address of the weight table of each lane
+        bool pairs; // any lane holds a mirror tuple
+    };
+    static constexpr size_t lane_count = (network::features + 7) / 8 * 8;
+
+    static const std::array<feature, network::features>& layout() {
+        static const std::array<feature, network::features> list = network::describe();
+        return list;
     }
 
-    int merge_tile(const int &tile) {
-        if (tile >= merge)
-            return merge;
-        return tile;
+    /**
+     * the vector kernels need AVX2 and BMI2 at runtime, dense float tables, tuples of one length,
+     * and tables small enough for 32-bit indices, since indices are computed with 32-bit lane multiplies
+     * simd=0 forces the scalar path, e.g., for comparison
+     */
+    void init_lanes() {
+        lanes.clear();
+        if (property.count("simd") && !int(property["simd"])) return;
+        if (qweights.size() || !__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("bmi2")) return;
+        for (const weight& w : weights)
+            if (w.sparse()) return;
+        for (size_t t = 0; t < weights.size(); t++)
+            if (network::size(t) > UINT32_MAX) return;
+        width = layout()[0].length;
+        for (const feature& f : layout())
+            if (f.length != width) return;
+        lanes.resize(lane_count / 8);
+        for (size_t i = 0; i < lane_count; i++) {
+            lane& v = lanes[i / 8];
+            const feature& f = layout()[std::min(i, network::features - 1)];
+            bool real = i < network::features;
+            for (size_t k = 0; k < width; k++) {
+                v.cell[k][i % 8] = int(0x80808000u | (real ? f.cell[k] : 0)); // the upper 3 bytes are zeroed
+                v.swap[k][i % 8] = int(0x80808000u | (real ? f.cell[k ^ f.mirror] : 0));
+            }
+            v.mirror[i % 8] = real && f.mirror ? -1 : 0;
+            v.valid[i % 8] = real ? -1 : 0;
+            v.base[i % 8] = reinterpret_cast<int64_t>(&weights[f.table][0]);
+            v.pairs = v.pairs || (real && f.mirror);
+        }
     }
 
-    size_t get_entry_axe(const int &a, const int &b, const int &c, const int &d, const int &e, const int &f) {
-        size_t entry = merge_tile(a);
-        entry *= TILENUMBER;
-        entry += merge_tile(b);
-        entry *= TILENUMBER;
-        entry += merge_tile(c);
-        entry *= TILENUMBER;
-        entry += merge_tile(d);
-        entry *= TILENUMBER;
-        entry += merge_tile(e);
-        entry *= TILENUMBER;
-        entry += merge_tile(f);
-        if (entry >= SIZE) {
-            std::cout << "index out of bound" << std::endl;
-            std::cout << "the axe: " << a << ' ' << b << ' ' << c << ' ' << d << ' ' << e << ' ' << f << std::endl;
+    /**
+     * the indices of all features, 8 per vector
+     * the 16 tiles are unpacked into bytes of one register, so every cell of every lane is a single byte shuffle
+     * a mirror tuple compares its pairs lane-wise first, then reads either cells or swapped cells
+     */
+    __attribute__((target("avx2,bmi2")))
+    void get_idx_avx2(const board& b, uint32_t* index) const {
+        const board::word raw = b;
+        const uint64_t bytes = 0x1f1f1f1f1f1f1f1full;
+        __m128i tile = _mm_set_epi64x(_pdep_u64(uint64_t(raw >> 40) & 0xffffffffffull, bytes),
+                                      _pdep_u64(uint64_t(raw) & 0xffffffffffull, bytes));
+        __m128i part = _mm_min_epu8(tile, _mm_set1_epi8(char(std::min(merge, network::tiles - 1))));
+        const __m256i tiles = _mm256_broadcastsi128_si256(tile), parts = _mm256_broadcastsi128_si256(part);
+        const __m256i radix = _mm256_set1_epi32(network::tiles);
+        for (size_t g = 0; g < lanes.size(); g++) {
+            const lane& v = lanes[g];
+            __m256i order = _mm256_setzero_si256();
+            if (v.pairs) {
+                __m256i open = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.mirror));
+                for (size_t k = 0; k < width; k += 2) {
+                    __m256i a = _mm256_shuffle_epi8(tiles, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.cell[k])));
+                    __m256i c = _mm256_shuffle_epi8(tiles, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.cell[k + 1])));
+                    __m256i gt = _mm256_cmpgt_epi32(a, c), lt = _mm256_cmpgt_epi32(c, a);
+                    order = _mm256_or_si256(order, _mm256_and_si256(open, gt));
+                    open = _mm256_andnot_si256(_mm256_or_si256(gt, lt), open);
+                }
+            }
+            __m256i entry = _mm256_setzero_si256();
+            for (size_t k = 0; k < width; k++) {
+                __m256i pos = _mm256_blendv_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.cell[k])),
+                                                 _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.swap[k])), order);
+                entry = _mm256_add_epi32(_mm256_mullo_epi32(entry, radix), _mm256_shuffle_epi8(parts, pos));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(index + g * 8), entry);
         }
+    }
 
-        return entry;
+    /**
+     * the sum of the weights at the indices from get_idx_avx2, gathered 4 lanes at a time from the absolute addresses base + 4 * index
+     * the gathers are plain loads, which are as relaxed as weight::load on x86
+     */
+    __attribute__((target("avx2")))
+    float sum_avx2(const uint32_t* index) const {
+        __m128 sum = _mm_setzero_ps();
+        for (size_t i = 0; i < lane_count; i += 4) {
+            const lane& v = lanes[i / 8];
+            __m256i offset = _mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(index + i))), 2);
+            __m256i addr = _mm256_add_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(v.base + i % 8)), offset);
+            __m128 mask = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v.valid + i % 8)));
+            sum = _mm_add_ps(sum, _mm256_mask_i64gather_ps(_mm_setzero_ps(), static_cast<const float*>(nullptr), addr, mask, 1));
+        }
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
     }
 
-/*
- *    outer(a) outer(b) x x
- *    outer(c) outer(d) x x
- *    outer(e) outer(f) x x
- *    xxxxxxxx xxxxxxxx x x
+private:
+    std::vector<weight> weights;
+    std::vector<qweight> qweights; // quantize=1 for inference on 16-bit tables instead of weights
+    std::vector<lane> lanes; // empty unless the AVX2 kernels are used
+    std::shared_ptr<checkpoint> snapshot; // with save=PATH, every=N episodes and/or period=T seconds also save while training
+    std::shared_ptr<region> shm; // shm=NAME shares the tables with other processes
+    size_t width;
+
+    std::vector<state> episode; // the afterstates of the episode, or only the last one when online
+    float alpha;
+    int merge;
+    bool train; // train=0 for inference only, without the episode buffer and TD updates
+    bool online; // td=online (default) updates every afterstate one move later, td=backward at the end of the episode
+
+private:
+    std::default_random_engine engine;
+};
+
+/**
+ * the network is chosen at compile time, e.g., make NETWORK=eight_six
+ */
+#ifndef NETWORK
+#define NETWORK axe_six
+#endif
+typedef basic_player<NETWORK> player;
+
+
+/**
+ * expectimax search over the afterstate values learned by basic_player
+ * the chance nodes follow rndenv, i.e., a 1-index tile (90%) or a 2-index tile (10%) on a uniformly chosen empty cell
  *
- *    x x outer(b) outer(a)
- *    x x outer(d) outer(c)
- *    x x outer(f) outer(e)
- *    x x xxxxxxxx xxxxxxxx
+ * depth=N: the search depth in chance layers (default 2), depth=0 plays the same as the player
+ * ms=T: the time budget per move in milliseconds, the search then deepens iteratively up to depth (default 8)
+ * prune=P: chance nodes reached with a probability below P are evaluated as leaves (default 0.0001)
+ * tt=K: the transposition table holds 2^K entries (default 20)
  *
- *    x inner(a) inner(b) x
- *    x inner(c) inner(d) x
- *    x inner(e) inner(f) x
- *    x xxxxxxxx xxxxxxxx x
+ * the search never trains; the weights are those of the player it is constructed from
  */
-    size_t get_entry_six(const int &a, const int &b, const int &c, const int &d, const int &e, const int &f, bool inner) {
-        size_t entry = 0;
-
-        if (!inner || (a < b || (a==b && c < d) || (a==b && c==d && e <= f))) {
-            entry *= TILENUMBER;
-            entry += merge_tile(a);
-            entry *= TILENUMBER;
-            entry += merge_tile(b);
-            entry *= TILENUMBER;
-            entry += merge_tile(c);
-            entry *= TILENUMBER;
-            entry += merge_tile(d);
-            entry *= TILENUMBER;
-            entry += merge_tile(e);
-            entry *= TILENUMBER;
-            entry += merge_tile(f);
+template<typename network>
+class basic_expectimax : public basic_player<network> {
+public:
+    basic_expectimax(const std::string& args = "") : basic_player<network>(args + " train=0") { init(); }
+    basic_expectimax(const std::string& args, const basic_player<network>& shared)
+        : basic_player<network>(args + " train=0", shared) { init(); }
+
+    virtual action take_action(const board& before) {
+        start = std::chrono::steady_clock::now();
+        nodes = 0;
+        timeout = false;
+        action best = search(before, budget > 0 ? 0 : limit);
+        for (int depth = 1; budget > 0 && depth <= limit; depth++) {
+            action move = search(before, depth);
+            if (timeout) break;
+            best = move;
         }
-        else {
-            entry *= TILENUMBER;
-            entry += merge_tile(b);
-            entry *= TILENUMBER;
-            entry += merge_tile(a);
-            entry *= TILENUMBER;
-            entry += merge_tile(d);
-            entry *= TILENUMBER;
-            entry += merge_tile(c);
-            entry *= TILENUMBER;
-            entry += merge_tile(f);
-            entry *= TILENUMBER;
-            entry += merge_tile(e);
+        return best;
+    }
+
+private:
+    void init() {
+        auto& property = this->property;
+        limit = property.count("depth") ? int(property["depth"]) : property.count("ms") ? 8 : 2;
+        budget = property.count("ms") ? double(property["ms"]) : 0;
+        prune = property.count("prune") ? float(property["prune"]) : 0.0001f;
+        int size = property.count("tt") ? int(property["tt"]) : 20;
+        table.assign(size_t(1) << size, entry());
+        mask = table.size() - 1;
+    }
+
+    action search(const board& before, const int& depth) {
+        action best;
+        float highest = -INFINITY;
+        for (int op = 0; op < 4; op++) {
+            board after = before;
+            int reward = after.move(op);
+            if (reward == -1) continue;
+            float value = reward + expect(after, depth, 1);
+            if (value > highest) {
+                highest = value;
+                best = action::move(op);
+            }
+        }
+        return best;
+    }
+
+    float maximize(const board& before, const int& depth, const float& prob) {
+        float highest = -INFINITY;
+        for (int op = 0; op < 4; op++) {
+            board after = before;
+            int reward = after.move(op);
+            if (reward == -1) continue;
+            highest = std::max(highest, reward + expect(after, depth, prob));
+        }
+        return highest != -INFINITY ? highest : 0; // no legal move, the game is over
+    }
+
+    float expect(const board& after, const int& depth, const float& prob) {
+        if (depth == 0 || prob < prune) return this->get_value(after);
+        if (++nodes % 16 == 0 && budget > 0) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            timeout = elapsed.count() > budget;
         }
+        if (timeout) return 0;
 
-        if (entry >= SIZE) {
-            std::cout << "index out of bound" << std::endl;
-            std::cout << "the 6-tuple: " << a << ' ' << b << ' ' << c << ' ' << d << ' ' << e << ' ' << f << std::endl;
+        // the values of symmetric afterstates are equal, so the table keeps one entry per equivalence class
+        board key = after.canonical();
+        entry& e = table[key.hash() & mask];
+        if (e.depth >= depth && e.key == key) return e.value;
+
+        int space[16], num = 0;
+        for (int pos = 0; pos < 16; pos++)
+            if (after(pos) == 0) space[num++] = pos;
+        if (num == 0) return this->get_value(after);
+
+        float value = 0;
+        for (int i = 0; i < num; i++) {
+            board b = after;
+            b.set(space[i], 1);
+            value += 0.9f * maximize(b, depth - 1, prob * 0.9f / num);
+            b.set(space[i], 2);
+            value += 0.1f * maximize(b, depth - 1, prob * 0.1f / num);
         }
+        value /= num;
 
-        return entry;
+        if (!timeout) {
+            e.key = key;
+            e.value = value;
+            e.depth = depth;
+        }
+        return value;
     }
 
 private:
-    std::vector<weight> weights;
-
-    struct state {
-        board after;
+    struct entry {
+        entry() : key(), value(0), depth(-1) {}
+        board key;
         float value;
-        int reward;
+        int depth;
     };
+    std::vector<entry> table;
+    size_t mask;
 
-    std::vector<state> episode;
-    float alpha;
-    int merge;
+    int limit;
+    double budget;
+    float prune;
 
-private:
-    std::default_random_engine engine;
-    unsigned int SIZE = pow(TILENUMBER, 6);
+    std::chrono::steady_clock::time_point start;
+    size_t nodes;
+    bool timeout;
 };
+
+typedef basic_expectimax<NETWORK> expectimax;
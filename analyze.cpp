@@ -0,0 +1,190 @@
+/**
+ * Replay and Analysis of Saved Statistics for Game 2584
+ * use 'make analyze' to compile the source
+ *
+ * usage: ./analyze [--block=N] [--bucket=N] [--threads=N] FILE...
+ * each FILE is either a statistic saved by '2584 --save' or an episode log written by '2584 --log',
+ * and the games of all files are analyzed in the given order
+ *
+ *  --block=N: also show every N games, in the same format as 2584 does
+ *  --bucket=N: the width of the score distribution (default: 20 buckets up to the maximum)
+ *  --threads=N: the number of replaying threads (default: all cores)
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include "board.h"
+#include "action.h"
+#include "weight.h"
+#include "journal.h"
+#include "statistic.h"
+
+/**
+ * the actions of a game, either as 16-bit opcodes of a saved statistic or as the compact ones of an episode log
+ */
+struct episode {
+    const char* data;
+    size_t length;
+    bool compact;
+    uint64_t time[2];
+};
+
+typedef statistic::result result;
+
+/**
+ * locate the records of a saved statistic, see the operator << of statistic
+ */
+void index(const std::string& path, const std::shared_ptr<const char>& file, const size_t& size, std::vector<episode>& list) {
+    const char* base = file.get();
+    size_t count = 0, pos = sizeof(size_t);
+    if (size >= pos) std::memcpy(&count, base, sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        episode e;
+        size_t length = 0;
+        if (pos + sizeof(size_t) <= size) std::memcpy(&length, base + pos, sizeof(size_t));
+        if (pos + sizeof(size_t) > size || length > (size - pos - sizeof(size_t)) / sizeof(short)
+                || pos + sizeof(size_t) + length * sizeof(short) + sizeof(e.time) > size) {
+            std::cerr << "unexpected end of binary: " << path << std::endl;
+            std::exit(1);
+        }
+        e.data = base + pos + sizeof(size_t);
+        e.length = length;
+        e.compact = false;
+        std::memcpy(e.time, e.data + length * sizeof(short), sizeof(e.time));
+        list.push_back(e);
+        pos += sizeof(size_t) + length * sizeof(short) + sizeof(e.time);
+    }
+}
+
+result replay(const episode& e) {
+    result r = {};
+    board game;
+    auto apply = [&](const action& move) {
+        r.score += std::max(move.apply(game), 0);
+        r.moves++;
+    };
+    if (e.compact) {
+        journal::episode log = { reinterpret_cast<const uint8_t*>(e.data), e.length, { e.time[0], e.time[1] } };
+        log.each(apply);
+    } else {
+        for (size_t i = 0; i < e.length; i++) {
+            short opcode;
+            std::memcpy(&opcode, e.data + i * sizeof(short), sizeof(short));
+            apply(action(int(opcode)));
+        }
+    }
+    r.tile = statistic::largest(game);
+    r.time[0] = e.time[0];
+    r.time[1] = e.time[1];
+    return r;
+}
+
+/**
+ * show the results in [begin, end) as statistic::show does
+ */
+void show(const std::string& label, const result* begin, const result* end) {
+    statistic::print(label, statistic::tabulate(begin, end));
+    std::cout << std::endl;
+}
+
+int main(int argc, const char* argv[]) {
+    std::cout << "2584-Analysis: ";
+    std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
+    std::cout << std::endl << std::endl;
+
+    size_t block = 0, bucket = 0, threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        std::string para(argv[i]);
+        if (para.find("--block=") == 0) {
+            block = std::stoull(para.substr(para.find("=") + 1));
+        } else if (para.find("--bucket=") == 0) {
+            bucket = std::stoull(para.substr(para.find("=") + 1));
+        } else if (para.find("--threads=") == 0) {
+            threads = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+        } else {
+            paths.push_back(para);
+        }
+    }
+
+    // map all files and locate their games, which is cheap compared to replaying them
+    std::vector<episode> list;
+    std::vector<std::shared_ptr<const char>> files;
+    std::vector<journal::view> logs;
+    for (const std::string& path : paths) {
+        if (journal::detect(path)) {
+            logs.emplace_back(path);
+            for (size_t i = 0; i < logs.back().size(); i++) {
+                journal::episode log = logs.back()[i];
+                list.push_back({ reinterpret_cast<const char*>(log.data), log.length, true, { log.time[0], log.time[1] } });
+            }
+        } else {
+            size_t size;
+            files.push_back(weight::map(path, size, false, MADV_SEQUENTIAL));
+            index(path, files.back(), size, list);
+        }
+    }
+    if (list.empty()) {
+        std::cerr << "no games to analyze" << std::endl;
+        return -1;
+    }
+
+    // replay the games in parallel, each thread claims a chunk at a time
+    std::vector<result> games(list.size());
+    std::atomic<size_t> claimed(0);
+    const size_t chunk = 4096;
+    auto worker = [&]() {
+        for (size_t begin; (begin = claimed.fetch_add(chunk)) < list.size(); ) {
+            size_t end = std::min(begin + chunk, list.size());
+            for (size_t i = begin; i < end; i++)
+                games[i] = replay(list[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t id = 1; id < threads; id++)
+        workers.emplace_back(worker);
+    worker();
+    for (std::thread& t : workers)
+        t.join();
+
+    // the time series, every 'block' games
+    for (size_t i = 0; block && i < games.size(); i += block) {
+        size_t end = std::min(i + block, games.size());
+        show(std::to_string(end), games.data() + i, games.data() + end);
+    }
+
+    // the tile table of all games
+    show("total " + std::to_string(games.size()), games.data(), games.data() + games.size());
+
+    // the percentiles of scores
+    std::vector<size_t> scores(games.size());
+    for (size_t i = 0; i < games.size(); i++)
+        scores[i] = games[i].score;
+    std::sort(scores.begin(), scores.end());
+    std::cout << "score";
+    for (double p : { 1.0, 10.0, 25.0, 50.0, 75.0, 90.0, 99.0, 99.9 }) {
+        size_t rank = std::min(size_t(p / 100 * scores.size()), scores.size() - 1);
+        std::cout << (p == 1.0 ? "\t" : ", ") << "p" << p << " = " << scores[rank];
+    }
+    std::cout << std::endl << std::endl;
+
+    // the distribution of scores
+    if (bucket == 0) bucket = std::max<size_t>((scores.back() + 19) / 20, 1);
+    std::cout << "score\tgames" << std::endl;
+    for (size_t low = 0, i = 0; i < scores.size(); low += bucket) {
+        size_t num = std::lower_bound(scores.begin() + i, scores.end(), low + bucket) - (scores.begin() + i);
+        i += num;
+        std::cout << "\t[" << low << ", " << (low + bucket) << ")\t" << (num * 100.0 / scores.size()) << "%" << std::endl;
+    }
+    std::cout << std::endl;
+
+    return 0;
+}
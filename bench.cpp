@@ -0,0 +1,308 @@
+/**
+ * Microbenchmarks of the Hot Paths for Game 2584
+ * use 'make bench' to compile and run them, or 'make benchmark' to compile only
+ *
+ * usage: ./benchmark [--games=N] [--seed=N] [--play=ARGS] [--counters] [--save=FILE] [--compare=FILE]
+ * the boards are collected from N games (default: 20) played with fixed seeds, so every build measures the same work
+ *
+ *  --play=ARGS: the arguments of the player, e.g., 'load=WEIGHTS' to measure the accesses of trained tables
+ *               instead of untouched ones, which all share the zero page
+ *  --counters: also count cycles, instructions, cache misses and branch misses by perf_event_open
+ *  --save=FILE: write the results as a baseline, one tab-separated line per benchmark
+ *  --compare=FILE: show the change of ns/op against a baseline saved before
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "statistic.h"
+
+/**
+ * the player with its feature extraction and evaluation opened up for measuring
+ */
+class probe : public player {
+public:
+    probe(const std::string& args) : player(args) {}
+    probe(const std::string& args, const probe& shared) : player(args, shared) {}
+    using player::get_idx_entry_list;
+    using player::get_value;
+};
+
+/**
+ * hardware counters of the calling thread, or none if perf_event_open is not permitted
+ */
+class counters {
+public:
+    static constexpr int kinds = 4;
+
+    counters(const bool& enable) {
+        const uint64_t config[kinds] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+        for (int i = 0; enable && i < kinds; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd == -1) {
+                std::cerr << "hardware counters are not available, see /proc/sys/kernel/perf_event_paranoid" << std::endl;
+                for (int f : fds) close(f);
+                fds.clear();
+                break;
+            }
+            fds.push_back(fd);
+        }
+    }
+    ~counters() { for (int f : fds) close(f); }
+
+    bool available() const { return fds.size(); }
+    void start() {
+        for (int f : fds) ioctl(f, PERF_EVENT_IOC_RESET, 0);
+        for (int f : fds) ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    void stop(uint64_t* value) {
+        for (int f : fds) ioctl(f, PERF_EVENT_IOC_DISABLE, 0);
+        for (size_t i = 0; i < fds.size(); i++)
+            if (read(fds[i], value + i, sizeof(uint64_t)) != sizeof(uint64_t)) value[i] = 0;
+    }
+
+private:
+    std::vector<int> fds;
+};
+
+/**
+ * accumulates the time and counters of the measured parts of a round
+ */
+class stopwatch {
+public:
+    stopwatch(counters& hw) : hw(hw), ns(0), value{} {}
+    void start() {
+        hw.start();
+        tick = std::chrono::steady_clock::now();
+    }
+    void stop() {
+        auto tock = std::chrono::steady_clock::now();
+        uint64_t v[counters::kinds] = {};
+        hw.stop(v);
+        ns += std::chrono::duration<double, std::nano>(tock - tick).count();
+        for (int i = 0; i < counters::kinds; i++) value[i] += v[i];
+    }
+
+    counters& hw;
+    double ns;
+    uint64_t value[counters::kinds];
+    std::chrono::steady_clock::time_point tick;
+};
+
+struct measure {
+    std::string name;
+    double ns;
+    double value[counters::kinds];
+};
+
+volatile uint64_t sink; // consumes results, so that the measured work is never optimized away
+
+/**
+ * run 'round' (which performs 'ops' operations) repeatedly for at least 'budget' seconds,
+ * and keep the fastest round, which is the least disturbed by the rest of the system
+ */
+measure run(const std::string& name, const size_t& ops, counters& hw, const std::function<void(stopwatch&)>& round, const double& budget = 0.5) {
+    measure best = { name, 0, {} };
+    { stopwatch warm(hw); round(warm); }
+    double spent = 0;
+    for (size_t n = 0; n < 3 || (spent < budget * 1e9 && n < 10000); n++) {
+        stopwatch w(hw);
+        round(w);
+        spent += w.ns;
+        if (n && w.ns / ops >= best.ns) continue;
+        best.ns = w.ns / ops;
+        for (int i = 0; i < counters::kinds; i++)
+            best.value[i] = double(w.value[i]) / ops;
+    }
+    return best;
+}
+
+std::map<std::string, double> baseline(const std::string& path) {
+    std::map<std::string, double> ns;
+    std::ifstream in(path.c_str());
+    if (!in.is_open()) {
+        std::cerr << "cannot open " << path << std::endl;
+        std::exit(-1);
+    }
+    for (std::string line; std::getline(in, line); ) {
+        if (line.empty() || line[0] == '#') continue;
+        std::stringstream ss(line);
+        std::string name;
+        double value;
+        if (ss >> name >> value) ns[name] = value;
+    }
+    return ns;
+}
+
+int main(int argc, const char* argv[]) {
+    std::cout << "2584-Benchmark: ";
+    std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
+    std::cout << std::endl << std::endl;
+
+    size_t games = 20;
+    std::string play_args, seed = "1", save, compare;
+    bool count = false;
+    for (int i = 1; i < argc; i++) {
+        std::string para(argv[i]);
+        if (para.find("--games=") == 0) {
+            games = std::stoull(para.substr(para.find("=") + 1));
+        } else if (para.find("--seed=") == 0) {
+            seed = para.substr(para.find("=") + 1);
+        } else if (para.find("--play=") == 0) {
+            play_args = para.substr(para.find("=") + 1);
+        } else if (para.find("--save=") == 0) {
+            save = para.substr(para.find("=") + 1);
+        } else if (para.find("--compare=") == 0) {
+            compare = para.substr(para.find("=") + 1);
+        } else if (para.find("--counters") == 0) {
+            count = true;
+        }
+    }
+    std::map<std::string, double> base;
+    if (compare.size()) base = baseline(compare);
+
+    // the corpus: the boards before and after every move of the player, and the games as records
+    probe play(play_args + " train=0 seed=" + seed);
+    rndenv evil("seed=" + seed);
+    std::vector<board> before, after;
+    std::vector<std::pair<size_t, size_t>> episode; // the range of 'before' of every game
+    statistic record(-1);
+    for (size_t n = 0; n < games; n++) {
+        evil.reseed(n);
+        episode.emplace_back(before.size(), before.size());
+        record.open_episode(play.name() + ":" + evil.name());
+        board game = record.make_empty_board();
+        while (true) {
+            agent& who = record.take_turns(play, evil);
+            if (&who == &play) before.push_back(game);
+            action move = who.take_action(game);
+            int reward = move.apply(game);
+            if (reward == -1) break;
+            record.save_action(move, reward);
+            if (&who == &play) after.push_back(game);
+            if (who.check_for_win(game)) break;
+        }
+        record.close_episode(play.name(), game);
+        episode.back().second = before.size();
+    }
+    std::cout << "corpus: " << games << " games, " << before.size() << " boards" << std::endl << std::endl;
+
+    counters hw(count);
+    std::vector<measure> result;
+    auto each = [&](const std::vector<board>& boards, const std::function<uint64_t(const board&)>& op) {
+        return [&boards, op](stopwatch& w) {
+            uint64_t sum = 0;
+            w.start();
+            for (const board& b : boards) sum += op(b);
+            w.stop();
+            sink = sum;
+        };
+    };
+
+    const char* dir[] = { "up", "right", "down", "left" };
+    for (int op = 0; op < 4; op++) {
+        result.push_back(run(std::string("board::move_") + dir[op], before.size(), hw,
+            each(before, [op](const board& b) { board t = b; return uint64_t(t.move(op)); })));
+    }
+    result.push_back(run("player::get_idx_entry_list", after.size(), hw,
+        each(after, [&](const board& b) { return uint64_t(play.get_idx_entry_list(b).back().second); })));
+    result.push_back(run("player::get_value", after.size(), hw,
+        each(after, [&](const board& b) { float v = play.get_value(b); uint64_t u = 0; std::memcpy(&u, &v, sizeof(v)); return u; })));
+    result.push_back(run("player::take_action", before.size(), hw,
+        each(before, [&](const board& b) { return uint64_t(int(play.take_action(b))); })));
+    result.push_back(run("rndenv::take_action", after.size(), hw,
+        each(after, [&](const board& b) { return uint64_t(int(evil.take_action(b))); })));
+
+    // the backward TD pass over the afterstates of each game, which trains (and thus changes) the tables, hence after the others
+    // loaded tables are mapped read-only for inference, so they are mapped again copy-on-write for training
+    if (play_args.find("quantize") == std::string::npos) {
+        std::string args = play_args + " train=1 td=backward seed=" + seed;
+        std::unique_ptr<probe> trainer(play_args.find("load=") == std::string::npos ? new probe(args, play) : new probe(args));
+        probe& learn = *trainer;
+        result.push_back(run("player::close_episode", after.size(), hw, [&](stopwatch& w) {
+            for (const std::pair<size_t, size_t>& range : episode) {
+                learn.open_episode();
+                for (size_t i = range.first; i < range.second; i++)
+                    learn.take_action(before[i]);
+                w.start();
+                learn.close_episode();
+                w.stop();
+            }
+        }));
+    }
+
+    // serialization of the recorded games, per game
+    std::string bytes;
+    result.push_back(run("statistic::save", games, hw, [&](stopwatch& w) {
+        std::ostringstream out;
+        w.start();
+        out << record;
+        w.stop();
+        bytes = out.str();
+    }));
+    result.push_back(run("statistic::load", games, hw, [&](stopwatch& w) {
+        std::istringstream in(bytes);
+        statistic stat(-1);
+        w.start();
+        in >> stat;
+        w.stop();
+    }));
+
+    std::cout << std::left << std::setw(32) << "benchmark" << std::right << std::setw(12) << "ns/op";
+    if (hw.available())
+        std::cout << std::setw(12) << "cycles" << std::setw(12) << "instr" << std::setw(12) << "cache-miss" << std::setw(12) << "br-miss";
+    if (base.size()) std::cout << std::setw(12) << "vs base";
+    std::cout << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (const measure& m : result) {
+        std::cout << std::left << std::setw(32) << m.name << std::right << std::setw(12) << m.ns;
+        for (int i = 0; hw.available() && i < counters::kinds; i++)
+            std::cout << std::setw(12) << m.value[i];
+        if (base.count(m.name))
+            std::cout << std::setw(11) << std::showpos << (m.ns / base[m.name] - 1) * 100 << std::noshowpos << "%";
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+
+    if (save.size()) {
+        std::ofstream out(save.c_str(), std::ios::out | std::ios::trunc);
+        if (!out.is_open()) return -1;
+        out << "# name\tns/op";
+        if (hw.available()) out << "\tcycles/op\tinstructions/op\tcache-misses/op\tbranch-misses/op";
+        out << std::endl << std::fixed << std::setprecision(2);
+        for (const measure& m : result) {
+            out << m.name << "\t" << m.ns;
+            for (int i = 0; hw.available() && i < counters::kinds; i++)
+                out << "\t" << m.value[i];
+            out << std::endl;
+        }
+    }
+
+    return 0;
+}
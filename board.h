@@ -2,13 +2,17 @@
 #include <array>
 #include <iostream>
 #include <cstdio>
+#include <cstdint>
 #include <algorithm>
 
 int i2t[] = {0, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377, 610, 987, 1597, 2584, 4181, 6765,
     10946, 17711, 28657, 46368, 75025, 121393, 196418, 317811, 514229, 832040, 1346269, 2178309, 3524578};
 
 /**
- * array-based board for 2048
+ * bitboard for 2584
+ *
+ * the 16 tile indices are packed into an 80-bit word, 5 bits per tile,
+ * so that each row is a contiguous 20-bit field
  *
  * index (2-d form):
  * [0][0] [0][1] [0][2] [0][3]
@@ -22,22 +26,58 @@ int i2t[] = {0, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377, 610, 987, 1597
  *  (8)  (9) (10) (11)
  * (12) (13) (14) (15)
  *
+ * tile (i) occupies bits [5i, 5i + 5), hence the largest storable tile index is 31
+ * the board also carries its Zobrist hash, see hash()
  */
 class board {
+public:
+    typedef unsigned __int128 word;
+
+    /**
+     * proxy returned by the non-const accessor, so that b(i) = t still works on packed storage
+     */
+    class cell {
+    public:
+        cell(board& b, const int& i) : b(b), i(i) {}
+        operator int() const { return b.at(i); }
+        cell& operator =(const int& t) { b.set(i, t); return *this; }
+        cell& operator =(const cell& c) { return *this = int(c); }
+    private:
+        board& b;
+        int i;
+    };
 
 public:
-    board() : tile() {}
+    board() : raw(0), key(0) {}
+    board(const word& raw) : raw(raw), key(rehash(raw)) {}
     board(const board& b) = default;
     board& operator =(const board& b) = default;
+    operator word() const { return raw; }
+
+    std::array<int, 4> operator [](const int& r) const { return {{ at(r * 4), at(r * 4 + 1), at(r * 4 + 2), at(r * 4 + 3) }}; }
+    cell operator ()(const int& i) { return cell(*this, i); }
+    int operator ()(const int& i) const { return at(i); }
+
+    int at(const int& i) const { return int(raw >> (5 * i)) & 0x1f; }
+    void set(const int& i, const int& t) {
+        key ^= zobrist(i, at(i)) ^ zobrist(i, t & 0x1f);
+        raw = (raw & ~(word(0x1f) << (5 * i))) | (word(t & 0x1f) << (5 * i));
+    }
 
-    std::array<int, 4>& operator [](const int& i) { return tile[i]; }
-    const std::array<int, 4>& operator [](const int& i) const { return tile[i]; }
-    int& operator ()(const int& i) { return tile[i / 4][i % 4]; }
-    const int& operator ()(const int& i) const { return tile[i / 4][i % 4]; }
+    /**
+     * Zobrist hash of the board, i.e., the xor of a random key for every (position, tile) pair on it
+     * the hash is carried with the board and kept up to date incrementally:
+     * empty cells have no key, so placing a tile (see set) xors in zobrist(i, t) only,
+     * a slide xors out and in the keys of the rows (or columns) it changed, and a symmetric transform
+     * rehashes the 16 cells from the 4 KiB key table, which stays in L1
+     */
+    uint64_t hash() const { return key; }
+
+    static uint64_t zobrist(const int& i, const int& t) { return lookup::key(i, t); }
 
 public:
-    bool operator ==(const board& b) const { return tile == b.tile; }
-    bool operator < (const board& b) const { return tile <  b.tile; }
+    bool operator ==(const board& b) const { return raw == b.raw; }
+    bool operator < (const board& b) const { return raw <  b.raw; }
     bool operator !=(const board& b) const { return !(*this == b); }
     bool operator > (const board& b) const { return b < *this; }
     bool operator <=(const board& b) const { return !(b < *this); }
@@ -59,73 +99,30 @@ public:
     }
 
     int move_left() {
-        board prev = *this;
-        int score = 0;
-        for (int r = 0; r < 4; r++) {
-            auto& row = tile[r];
-            int top = 0, hold = 0;
-            for (int c = 0; c < 4; c++) {
-                int tile = row[c];
-                if (tile == 0) continue;
-                row[c] = 0;
-                if (hold) {
-                    if (mergeable(tile, hold)) {
-                        int new_tile = std::max(tile, hold) + 1;
-                        row[top++] = new_tile;
-                        score += i2t[new_tile];
-                        hold = 0;
-                    } else {
-                        row[top++] = hold;
-                        hold = tile;
-                    }
-                } else {
-                    hold = tile;
-                }
-            }
-            if (hold) tile[r][top] = hold;
-        }
-        return (*this != prev) ? score : -1;
+        return slide(0, false);
     }
     int move_right() {
-        reflect_horizontal();
-        int score = move_left();
-        reflect_horizontal();
-        return score;
+        return slide(1, false);
     }
     int move_up() {
-        rotate_right();
-        int score = move_right();
-        rotate_left();
+        raw = transpose(raw);
+        int score = slide(0, true);
+        raw = transpose(raw);
         return score;
     }
     int move_down() {
-        rotate_right();
-        int score = move_left();
-        rotate_left();
+        raw = transpose(raw);
+        int score = slide(1, true);
+        raw = transpose(raw);
         return score;
     }
 
-    void transpose() {
-        for (int r = 0; r < 4; r++) {
-            for (int c = r + 1; c < 4; c++) {
-                std::swap(tile[r][c], tile[c][r]);
-            }
-        }
-    }
-
-    void reflect_horizontal() {
-        for (int r = 0; r < 4; r++) {
-            std::swap(tile[r][0], tile[r][3]);
-            std::swap(tile[r][1], tile[r][2]);
-        }
-    }
-
-    void reflect_vertical() {
-        for (int c = 0; c < 4; c++) {
-            std::swap(tile[0][c], tile[3][c]);
-            std::swap(tile[1][c], tile[2][c]);
-        }
-    }
+    /**
+     * the symmetric transforms rehash the board once, see hash()
+     */
+    void transpose() { reset(transpose(raw)); }
+    void reflect_horizontal() { reset(reflect_horizontal(raw)); }
+    void reflect_vertical() { reset(reflect_vertical(raw)); }
 
     /**
      * rotate the board clockwise by given times
@@ -140,9 +137,54 @@ public:
         }
     }
 
-    void rotate_right() { transpose(); reflect_horizontal(); } // clockwise
-    void rotate_left() { transpose(); reflect_vertical(); } // counterclockwise
-    void reverse() { reflect_horizontal(); reflect_vertical(); }
+    void rotate_right() { reset(reflect_horizontal(transpose(raw))); } // clockwise
+    void rotate_left() { reset(reflect_vertical(transpose(raw))); } // counterclockwise
+    void reverse() { reset(reflect_vertical(reflect_horizontal(raw))); }
+
+    /**
+     * apply symmetry 's', numbered as in network.h, i.e., rotate clockwise s times for s < 4,
+     * or reflect horizontally, then rotate clockwise s - 4 times
+     */
+    void transform(const int& s) {
+        word w = s >= 4 ? reflect_horizontal(raw) : raw;
+        switch (s % 4) {
+        default:
+        case 0: break;
+        case 1: w = reflect_horizontal(transpose(w)); break;
+        case 2: w = reflect_vertical(reflect_horizontal(w)); break;
+        case 3: w = reflect_vertical(transpose(w)); break;
+        }
+        reset(w);
+    }
+
+    /**
+     * the symmetry which undoes symmetry 's'
+     */
+    static int inverse(const int& s) { return s < 4 ? (4 - s) % 4 : s; }
+
+    /**
+     * the minimal board among the 8 symmetries, which is the same for every board of an equivalence class,
+     * so that caches (e.g., the transposition table of basic_expectimax) keep one entry per class
+     * 'symmetry' receives the symmetry which maps this board to it, see transform
+     */
+    board canonical(int& symmetry) const {
+        // the 4 reflections and their transposes take 7 transforms, instead of 13 by rotating one by one
+        // only the chosen one is rehashed
+        static const int which[8] = { 0, 4, 6, 2, 7, 3, 1, 5 };
+        word b[8] = { raw, reflect_horizontal(raw), reflect_vertical(raw) };
+        b[3] = reflect_vertical(b[1]);
+        for (int i = 0; i < 4; i++)
+            b[i + 4] = transpose(b[i]);
+        int min = 0;
+        for (int i = 1; i < 8; i++)
+            if (b[i] < b[min] || (b[i] == b[min] && which[i] < which[min])) min = i;
+        symmetry = which[min];
+        return board(b[min]);
+    }
+    board canonical() const {
+        int symmetry;
+        return canonical(symmetry);
+    }
 
 public:
     friend std::ostream& operator <<(std::ostream& out, const board& b) {
@@ -161,8 +203,163 @@ public:
     }
 
 private:
-    std::array<std::array<int, 4>, 4> tile;
-    bool mergeable(int i1, int i2) {
-        return (i1 == 1 && i1 == i2) || ((i1 != 0 && i2 != 0) && (i1 - i2 == 1 || i2 - i1 == 1));
+    /**
+     * the symmetric transforms of a packed word move whole groups of tiles with one mask and shift each,
+     * e.g., transpose shifts tile (r, c) by 15 * (c - r) bits
+     */
+    static word transpose(const word& raw) {
+        return (raw & mask(0x8421))
+            | ((raw & mask(0x0842)) << 15) | ((raw & mask(0x4210)) >> 15)
+            | ((raw & mask(0x0084)) << 30) | ((raw & mask(0x2100)) >> 30)
+            | ((raw & mask(0x0008)) << 45) | ((raw & mask(0x1000)) >> 45);
+    }
+
+    static word reflect_horizontal(const word& raw) {
+        return ((raw & mask(0x1111)) << 15) | ((raw & mask(0x2222)) << 5)
+             | ((raw & mask(0x4444)) >> 5)  | ((raw & mask(0x8888)) >> 15);
+    }
+
+    static word reflect_vertical(const word& raw) {
+        return ((raw & mask(0x000f)) << 60) | ((raw & mask(0x00f0)) << 20)
+             | ((raw & mask(0x0f00)) >> 20) | ((raw & mask(0xf000)) >> 60);
+    }
+
+    void reset(const word& w) {
+        raw = w;
+        key = rehash(w);
+    }
+
+    static uint64_t rehash(const word& raw) {
+        uint64_t h = 0;
+        for (int i = 0; i < 16; i++)
+            h ^= zobrist(i, int(raw >> (5 * i)) & 0x1f);
+        return h;
+    }
+
+    static uint64_t rotl(const uint64_t& x, const int& n) { return (x << n) | (x >> ((64 - n) & 63)); }
+
+    /**
+     * the mask covering the tiles whose 1-d indices are set in 'cells'
+     */
+    static constexpr word mask(const int& cells) {
+        return mask(cells, 0) | mask(cells, 1) | mask(cells, 2) | mask(cells, 3)
+             | mask(cells, 4) | mask(cells, 5) | mask(cells, 6) | mask(cells, 7)
+             | mask(cells, 8) | mask(cells, 9) | mask(cells, 10) | mask(cells, 11)
+             | mask(cells, 12) | mask(cells, 13) | mask(cells, 14) | mask(cells, 15);
+    }
+    static constexpr word mask(const int& cells, const int& i) {
+        return ((cells >> i) & 1) ? word(0x1f) << (5 * i) : word(0);
     }
+
+    /**
+     * slide every row to the left (0) or to the right (1)
+     * each row costs one table lookup, and the move is legal iff any row changed
+     * with 'columns', the board is transposed, i.e., row r holds column r, which decides the cells of the keys
+     */
+    int slide(const int& dir, const bool& columns) {
+        uint32_t moved = 0;
+        int score = 0;
+        for (int r = 0; r < 4; r++) {
+            uint32_t row = uint32_t(raw >> (20 * r)) & 0xfffff;
+            const lookup::entry& e = lookup::find(row);
+            raw ^= word(e.delta[dir]) << (20 * r);
+            score += e.score[dir];
+            moved |= e.delta[dir];
+            key ^= columns ? rotl(e.col[dir], 4 * r) : rotl(e.row[dir], 16 * r);
+        }
+        return moved ? score : -1;
+    }
+
+    /**
+     * row-move engine, maps every 20-bit row to its left-slid and right-slid results and rewards
+     * the results are kept as xor deltas from the original row, so a zero delta means the row does not change
+     * also holds the Zobrist keys, see hash()
+     * built once at startup, the keys come from a fixed seed so that hashes are stable across runs
+     *
+     * the key of tile t on cell i is that of the tile rotated left by 4i bits, i.e., by 16r + 4c for cell (r, c),
+     * so the keys of a line differ from those of row 0 (or column 0) by a rotation of the whole line,
+     * and every entry also keeps the change of the keys of its line as row 0 and as column 0
+     */
+    class lookup {
+    public:
+        struct entry {
+            uint32_t delta[2];
+            uint32_t score[2];
+            uint64_t row[2]; // the change of the keys, as row 0, i.e., rotated by 16r for row r
+            uint64_t col[2]; // the same as column 0, i.e., rotated by 4c for column c
+        };
+
+        static const entry& find(const uint32_t& row) { return table.rows[row]; }
+        static uint64_t key(const int& i, const int& t) { return table.keys[i][t]; }
+
+    private:
+        lookup() {
+            uint64_t seed = 0, tile[32] = {};
+            for (int t = 1; t < 32; t++) {
+                uint64_t z = (seed += 0x9e3779b97f4a7c15ull); // splitmix64
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                tile[t] = z ^ (z >> 31);
+            }
+            for (int i = 0; i < 16; i++)
+                for (int t = 0; t < 32; t++)
+                    keys[i][t] = rotl(tile[t], 4 * i);
+            for (uint32_t row = 0; row < (1 << 20); row++) {
+                int tile[4] = { int(row & 0x1f), int((row >> 5) & 0x1f), int((row >> 10) & 0x1f), int((row >> 15) & 0x1f) };
+                int left[4] = { tile[0], tile[1], tile[2], tile[3] };
+                int right[4] = { tile[3], tile[2], tile[1], tile[0] };
+                rows[row].score[0] = slide(left);
+                rows[row].score[1] = slide(right);
+                rows[row].delta[0] = row ^ (left[0] | (left[1] << 5) | (left[2] << 10) | (left[3] << 15));
+                rows[row].delta[1] = row ^ (right[3] | (right[2] << 5) | (right[1] << 10) | (right[0] << 15));
+                for (int dir = 0; dir < 2; dir++) {
+                    rows[row].row[dir] = rows[row].col[dir] = 0;
+                    for (int c = 0; c < 4; c++) {
+                        int from = (row >> (5 * c)) & 0x1f, to = ((row ^ rows[row].delta[dir]) >> (5 * c)) & 0x1f;
+                        rows[row].row[dir] ^= keys[c][from] ^ keys[c][to];
+                        rows[row].col[dir] ^= keys[4 * c][from] ^ keys[4 * c][to];
+                    }
+                }
+            }
+        }
+
+        static int slide(int (&row)[4]) {
+            int score = 0;
+            int top = 0, hold = 0;
+            for (int c = 0; c < 4; c++) {
+                int tile = row[c];
+                if (tile == 0) continue;
+                row[c] = 0;
+                if (hold) {
+                    if (mergeable(tile, hold)) {
+                        int new_tile = std::max(tile, hold) + 1;
+                        row[top++] = new_tile;
+                        score += i2t[new_tile];
+                        hold = 0;
+                    } else {
+                        row[top++] = hold;
+                        hold = tile;
+                    }
+                } else {
+                    hold = tile;
+                }
+            }
+            if (hold) row[top] = hold;
+            return score;
+        }
+
+        static bool mergeable(int i1, int i2) {
+            if (std::max(i1, i2) >= 31) return false; // the merged tile would not fit in 5 bits
+            return (i1 == 1 && i1 == i2) || ((i1 != 0 && i2 != 0) && (i1 - i2 == 1 || i2 - i1 == 1));
+        }
+
+        static lookup table;
+        std::array<entry, 1 << 20> rows;
+        uint64_t keys[16][32];
+    };
+
+    word raw;
+    uint64_t key;
 };
+
+board::lookup board::lookup::table;
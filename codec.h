@@ -0,0 +1,303 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include "weight.h"
+
+/**
+ * versioned weight files, compressed block by block
+ *
+ * the layout would be
+ *   header: "2584WGT" '\0', version (uint32), entries per block (uint32), offset of index (uint64), checksum of index (uint32),
+ *           length of network (uint32), network, count of tables (uint64), size of every table (uint64 x count)
+ *   blocks: every table cut into blocks, each compressed on its own
+ *   index:  offset (uint64), compressed length (uint32) and checksum (uint32) of every block, table by table
+ *
+ * 'network' describes the tuples which index the tables, so that a file is never read into another network
+ * a block is a sequence of runs, each of which is a count of zeros (uint32), a count of literals (uint32), then the literals
+ * most entries of a trained table are never visited and thus zero, so a file is a small part of the tables
+ * the checksums are CRC-32C; the offset of the index is written last, so a file cut short is told from a corrupted one
+ * blocks are independent, so they are encoded and decoded by several threads
+ */
+class codec {
+public:
+    static constexpr uint32_t version = 1;
+    static constexpr size_t block = 1 << 20;
+
+    /**
+     * whether 'path' is a file of this format rather than a raw one, see weight::operator <<
+     */
+    static bool detect(const std::string& path) {
+        char head[8] = {};
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        bool match = ::read(fd, head, sizeof(head)) == sizeof(head) && std::memcmp(head, magic, sizeof(head)) == 0;
+        close(fd);
+        return match;
+    }
+
+    /**
+     * write 'tables' to 'fd' by 'threads' threads
+     * with one thread, it makes only system calls, so that it is safe in a forked child, see checkpoint
+     */
+    static bool write(const int& fd, const std::vector<weight>& tables, const std::string& network, const size_t& threads = 1) {
+        size_t blocks = 0;
+        for (const weight& w : tables) blocks += (w.size() + block - 1) / block;
+        size_t batch = std::max<size_t>(threads, 1) * 2;
+        size_t slot = bound(block) + sizeof(float) * block; // the encoded block, and the entries of a sparse one
+        scratch memory(sizeof(entry) * blocks + batch * slot);
+        if (!memory.base) return false;
+        entry* index = reinterpret_cast<entry*>(memory.base);
+        char* slots = memory.base + sizeof(entry) * blocks;
+
+        uint32_t head[] = { version, uint32_t(block), 0, 0, 0, uint32_t(network.size()) };
+        uint64_t count = tables.size();
+        bool ok = put(fd, magic, 8) && put(fd, head, sizeof(head)) && put(fd, network.data(), network.size()) && put(fd, &count, sizeof(count));
+        for (const weight& w : tables) {
+            uint64_t size = w.size();
+            ok = ok && put(fd, &size, sizeof(size));
+        }
+        uint64_t offset = 8 + sizeof(head) + network.size() + sizeof(uint64_t) * (count + 1);
+
+        // a batch of blocks is encoded in parallel, then written in order
+        for (size_t first = 0; ok && first < blocks; first += batch) {
+            size_t num = std::min(batch, blocks - first);
+            parallel(num, threads, [&](const size_t& k) {
+                size_t t, begin;
+                locate(tables, first + k, t, begin);
+                const weight& w = tables[t];
+                size_t n = std::min<size_t>(size_t(block), w.size() - begin);
+                char* out = slots + k * slot;
+                float* staged = reinterpret_cast<float*>(out + bound(block));
+                for (size_t i = 0; w.sparse() && i < n; i++)
+                    staged[i] = w.load(begin + i);
+                const float* src = w.sparse() ? staged : &w[begin];
+                index[first + k].length = encode(src, n, out);
+                index[first + k].crc = crc32c(out, index[first + k].length);
+            });
+            for (size_t k = 0; ok && k < num; k++) {
+                index[first + k].offset = offset;
+                ok = put(fd, slots + k * slot, index[first + k].length);
+                offset += index[first + k].length;
+            }
+        }
+
+        uint32_t crc = crc32c(index, sizeof(entry) * blocks);
+        ok = ok && put(fd, index, sizeof(entry) * blocks);
+        ok = ok && pwrite(fd, &crc, sizeof(crc), 24) == sizeof(crc);
+        ok = ok && pwrite(fd, &offset, sizeof(offset), 16) == sizeof(offset);
+        return ok;
+    }
+
+    /**
+     * read 'path' into 'tables' by 'threads' threads
+     * dense tables of the sizes in the file are allocated if 'tables' is empty; otherwise their sizes must match,
+     * and they must be dense and zero, since runs of zeros are skipped rather than written
+     */
+    static void read(const std::string& path, std::vector<weight>& tables, const std::string& network, const size_t& threads) {
+        size_t size = 0;
+        std::shared_ptr<char> file = weight::map(path, size, false);
+        const char* base = file.get();
+        madvise(file.get(), size, MADV_WILLNEED);
+        auto get = [&](const size_t& at, void* out, const size_t& len) {
+            if (at + len > size) fail(path, "is truncated");
+            std::memcpy(out, base + at, len);
+        };
+
+        char head[8] = {};
+        uint32_t ver = 0, entries = 0, crc = 0, length = 0;
+        uint64_t end = 0, count = 0;
+        get(0, head, sizeof(head));
+        get(8, &ver, sizeof(ver));
+        get(12, &entries, sizeof(entries));
+        get(16, &end, sizeof(end));
+        get(24, &crc, sizeof(crc));
+        get(28, &length, sizeof(length));
+        if (std::memcmp(head, magic, sizeof(head)) != 0) fail(path, "is not a weight file");
+        if (ver != version) fail(path, "has unsupported version " + std::to_string(ver));
+        if (length > size - 32) fail(path, "is truncated");
+        if (std::string(base + 32, length) != network) fail(path, "was saved from another network");
+        get(32 + length, &count, sizeof(count));
+        if (count > size / sizeof(uint64_t)) fail(path, "is truncated");
+        std::vector<uint64_t> sizes(count);
+        get(40 + length, sizes.data(), sizeof(uint64_t) * count);
+        uint64_t data = 40 + length + sizeof(uint64_t) * count;
+
+        if (tables.empty()) {
+            for (uint64_t n : sizes)
+                tables.push_back(weight(n));
+        }
+        bool match = tables.size() == count && entries;
+        size_t blocks = 0;
+        for (size_t t = 0; match && t < count; t++) {
+            match = tables[t].size() == sizes[t] && !tables[t].sparse();
+            blocks += (sizes[t] + entries - 1) / entries;
+        }
+        if (!match) fail(path, "does not match the tables");
+        if (end == 0 || end < data || end > size || (size - end) / sizeof(entry) < blocks) fail(path, "is truncated");
+        const entry* index = reinterpret_cast<const entry*>(base + end);
+        if (crc32c(index, sizeof(entry) * blocks) != crc) fail(path, "has a corrupted index");
+
+        // each thread claims a block at a time, and the first corrupted one (if any) is reported
+        std::atomic<size_t> bad(blocks);
+        parallel(blocks, threads, [&](const size_t& b) {
+            entry e;
+            std::memcpy(&e, index + b, sizeof(e));
+            size_t t, begin;
+            locate(tables, b, t, begin, entries);
+            size_t n = std::min<size_t>(entries, tables[t].size() - begin);
+            bool ok = e.offset >= data && e.offset <= end && e.length <= end - e.offset
+                && crc32c(base + e.offset, e.length) == e.crc && decode(base + e.offset, e.length, &tables[t][begin], n);
+            for (size_t last = bad; !ok && b < last && !bad.compare_exchange_weak(last, b); );
+        });
+        if (bad < blocks) {
+            size_t t, begin;
+            locate(tables, bad, t, begin, entries);
+            fail(path, "has a corrupted block at entry " + std::to_string(begin) + " of table " + std::to_string(t));
+        }
+    }
+
+private:
+    struct entry {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t crc;
+    };
+
+    /**
+     * anonymous memory instead of the heap, see write
+     */
+    struct scratch {
+        scratch(const size_t& bytes) : bytes(bytes) {
+            void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            base = addr != MAP_FAILED ? static_cast<char*>(addr) : nullptr;
+        }
+        ~scratch() { if (base) munmap(base, bytes); }
+        char* base;
+        size_t bytes;
+    };
+
+    /**
+     * the largest encoded block of 'n' entries, where every run but the last covers at least 2 zeros
+     */
+    static size_t bound(size_t n) {
+        return sizeof(float) * n + 2 * sizeof(uint32_t) * (n / 3 + 2);
+    }
+
+    /**
+     * the 'b'-th block is at entry 'begin' of table 't'
+     */
+    static void locate(const std::vector<weight>& tables, size_t b, size_t& t, size_t& begin, size_t entries = block) {
+        for (t = 0; t < tables.size(); t++) {
+            size_t num = (tables[t].size() + entries - 1) / entries;
+            if (b < num) break;
+            b -= num;
+        }
+        begin = b * entries;
+    }
+
+    /**
+     * a literal run ends at 2 zeros in a row, since a run of zeros costs 8 bytes
+     * entries are compared bitwise, so that -0.0 is kept
+     */
+    static size_t encode(const float* src, const size_t& n, char* out) {
+        const uint32_t* v = reinterpret_cast<const uint32_t*>(src);
+        char* p = out;
+        for (size_t i = 0; i < n; ) {
+            size_t z = i;
+            while (z + 4 <= n && (v[z] | v[z + 1] | v[z + 2] | v[z + 3]) == 0) z += 4;
+            while (z < n && v[z] == 0) z++;
+            size_t l = z;
+            while (l < n && (v[l] != 0 || (l + 1 < n && v[l + 1] != 0))) l++;
+            uint32_t run[] = { uint32_t(z - i), uint32_t(l - z) };
+            std::memcpy(p, run, sizeof(run));
+            std::memcpy(p + sizeof(run), v + z, sizeof(float) * (l - z));
+            p += sizeof(run) + sizeof(float) * (l - z);
+            i = l;
+        }
+        return p - out;
+    }
+
+    static bool decode(const char* in, const size_t& length, float* dst, const size_t& n) {
+        size_t at = 0, i = 0;
+        while (at < length) {
+            uint32_t run[2];
+            if (length - at < sizeof(run)) return false;
+            std::memcpy(run, in + at, sizeof(run));
+            at += sizeof(run);
+            if (run[0] > n - i || run[1] > n - i - run[0] || run[1] > (length - at) / sizeof(float)) return false;
+            i += run[0];
+            std::memcpy(dst + i, in + at, sizeof(float) * run[1]);
+            i += run[1];
+            at += sizeof(float) * run[1];
+        }
+        return i == n;
+    }
+
+    /**
+     * run job(k) for every k in [0, num) by 'threads' threads, or by the calling thread alone
+     */
+    template<typename work>
+    static void parallel(const size_t& num, const size_t& threads, work&& job) {
+        if (threads <= 1 || num <= 1) {
+            for (size_t k = 0; k < num; k++) job(k);
+            return;
+        }
+        std::atomic<size_t> next(0);
+        auto worker = [&]() { for (size_t k; (k = next++) < num; ) job(k); };
+        std::vector<std::thread> workers;
+        for (size_t id = 1; id < std::min(threads, num); id++)
+            workers.emplace_back(worker);
+        worker();
+        for (std::thread& t : workers)
+            t.join();
+    }
+
+    static uint32_t crc32c(const void* data, const size_t& size) {
+        return __builtin_cpu_supports("sse4.2") ? crc32c_sse(data, size) : crc32c_bitwise(data, size);
+    }
+
+    __attribute__((target("sse4.2")))
+    static uint32_t crc32c_sse(const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        uint64_t crc = 0xffffffff;
+        for (; size >= 8; p += 8, size -= 8) {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            crc = _mm_crc32_u64(crc, word);
+        }
+        uint32_t c = crc;
+        for (; size; p++, size--)
+            c = _mm_crc32_u8(c, *p);
+        return ~c;
+    }
+
+    static uint32_t crc32c_bitwise(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        uint32_t c = 0xffffffff;
+        for (; size; p++, size--) {
+            c ^= *p;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+        }
+        return ~c;
+    }
+
+    static bool put(const int& fd, const void* data, const size_t& size) { return weight::put(fd, data, size); }
+
+    static void fail(const std::string& path, const std::string& why) {
+        std::cerr << "weight file " << path << " " << why << std::endl;
+        std::exit(1);
+    }
+
+    static constexpr const char* magic = "2584WGT";
+};
@@ -0,0 +1,245 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "action.h"
+#include "weight.h"
+
+/**
+ * append-only episode log, written episode by episode as they close
+ *
+ * the layout would be
+ *   header:  "2584LOG" '\0', version (uint32), 0 (uint32)
+ *   episode: length of actions in bytes (uint32), start and end time in ms (uint64 x 2), actions
+ *   ...
+ *   footer:  offset of every episode (uint64 x count), count (uint64), offset of footer (uint64), "2584IDX" '\0'
+ *
+ * an action takes 1 byte, its opcode, unless the opcode is 255 or above, which takes 0xff and 2 more bytes
+ * the footer is written when the log is closed; a log without it, e.g., after a crash, is recovered by scanning
+ * the episodes from the header, and reopening a log for appending drops the footer or any incomplete episode
+ */
+class journal {
+public:
+    /**
+     * an episode of a mapped log, valid as long as the view
+     */
+    struct episode {
+        const uint8_t* data;
+        size_t length;
+        uint64_t time[2];
+
+        std::vector<action> actions() const {
+            std::vector<action> list;
+            list.reserve(length);
+            each([&](const action& act) { list.push_back(act); });
+            return list;
+        }
+
+        /**
+         * visit the actions in order without copying them
+         */
+        template<typename visit>
+        void each(visit&& f) const {
+            for (size_t i = 0; i < length; i++) {
+                int opcode = data[i];
+                if (opcode == 0xff && i + 2 < length) {
+                    opcode = data[i + 1] | (data[i + 2] << 8);
+                    i += 2;
+                }
+                f(action(opcode));
+            }
+        }
+    };
+
+    /**
+     * read-only mapping of a log, with random access to its episodes
+     */
+    class view {
+    public:
+        view(const std::string& path) : length(0), end(0) {
+            file = weight::map(path, length, false, MADV_SEQUENTIAL);
+            if (!file || !is_log(file.get(), length)) {
+                std::cerr << "not an episode log: " << path << std::endl;
+                std::exit(-1);
+            }
+            uint32_t ver;
+            std::memcpy(&ver, file.get() + 8, sizeof(ver));
+            if (ver != version) {
+                std::cerr << "unsupported episode log version " << ver << ": " << path << std::endl;
+                std::exit(-1);
+            }
+            index();
+        }
+
+        size_t size() const { return offset.size(); }
+
+        episode operator [](const size_t& i) const {
+            episode e;
+            std::memcpy(&e.time, file.get() + offset[i] + sizeof(uint32_t), sizeof(e.time));
+            uint32_t len;
+            std::memcpy(&len, file.get() + offset[i], sizeof(len));
+            e.length = len;
+            e.data = reinterpret_cast<const uint8_t*>(file.get() + offset[i] + entry_head);
+            return e;
+        }
+
+    private:
+        friend class journal;
+
+        /**
+         * read the footer if it is intact, otherwise scan the complete episodes
+         * a footer is intact only if every episode it lists lies within the episodes, one after another;
+         * if only its list is damaged, the scan stops where the footer begins
+         */
+        void index() {
+            const char* base = file.get();
+            size_t limit = length;
+            if (length >= header + footer_tail) {
+                uint64_t count, at;
+                std::memcpy(&count, base + length - footer_tail, sizeof(count));
+                std::memcpy(&at, base + length - footer_tail + sizeof(count), sizeof(at));
+                if (std::memcmp(base + length - 8, footer_magic, 8) == 0 && at >= header && at <= length - footer_tail
+                        && count == (length - footer_tail - at) / sizeof(uint64_t)
+                        && at + count * sizeof(uint64_t) + footer_tail == length) {
+                    limit = at;
+                    offset.resize(count);
+                    std::memcpy(offset.data(), base + at, count * sizeof(uint64_t));
+                    bool valid = true;
+                    for (uint64_t i = 0, next = header; valid && i < count; i++) {
+                        uint32_t len = 0;
+                        valid = offset[i] >= next && offset[i] <= at && at - offset[i] >= entry_head;
+                        if (valid) std::memcpy(&len, base + offset[i], sizeof(len));
+                        valid = valid && at - offset[i] - entry_head >= len;
+                        next = offset[i] + entry_head + len;
+                    }
+                    if (valid) {
+                        end = at;
+                        return;
+                    }
+                    offset.clear();
+                }
+            }
+            end = header;
+            while (end + entry_head <= limit) {
+                uint32_t len;
+                std::memcpy(&len, base + end, sizeof(len));
+                if (end + entry_head + len > limit) break;
+                offset.push_back(end);
+                end += entry_head + len;
+            }
+        }
+
+        std::shared_ptr<const char> file;
+        size_t length;
+        size_t end; // the end of the last complete episode
+        std::vector<uint64_t> offset;
+    };
+
+public:
+    /**
+     * open 'path' for appending, creating it if it does not exist
+     */
+    journal(const std::string& path) : path(path), fd(-1), end(header) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && st.st_size > 0) {
+            {
+                view log(path);
+                offset = log.offset;
+                end = log.end;
+            }
+            if (truncate(path.c_str(), end) != 0) fail();
+            fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        } else {
+            fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+            char head[header] = {};
+            std::memcpy(head, header_magic, 8);
+            uint32_t ver = version;
+            std::memcpy(head + 8, &ver, sizeof(ver));
+            if (fd == -1 || write(fd, head, header) != ssize_t(header)) fail();
+        }
+        if (fd == -1) fail();
+    }
+    journal(const journal&) = delete;
+    journal& operator =(const journal&) = delete;
+
+    /**
+     * close the log with its footer
+     */
+    ~journal() {
+        std::vector<char> buf(offset.size() * sizeof(uint64_t) + footer_tail);
+        uint64_t count = offset.size(), at = end;
+        std::memcpy(buf.data(), offset.data(), count * sizeof(uint64_t));
+        std::memcpy(buf.data() + count * sizeof(uint64_t), &count, sizeof(count));
+        std::memcpy(buf.data() + count * sizeof(uint64_t) + sizeof(count), &at, sizeof(at));
+        std::memcpy(buf.data() + buf.size() - 8, footer_magic, 8);
+        if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) fail();
+        close(fd);
+    }
+
+    /**
+     * append an episode with a single write, so that a crash loses at most the episode being written
+     */
+    void append(const std::vector<action>& actions, const uint64_t (&time)[2]) {
+        buffer.resize(entry_head);
+        for (const action& act : actions) {
+            int opcode = act;
+            if (opcode >= 0 && opcode < 0xff) {
+                buffer.push_back(char(opcode));
+            } else {
+                buffer.push_back(char(0xff));
+                buffer.push_back(char(opcode & 0xff));
+                buffer.push_back(char((opcode >> 8) & 0xff));
+            }
+        }
+        uint32_t len = buffer.size() - entry_head;
+        std::memcpy(buffer.data(), &len, sizeof(len));
+        std::memcpy(buffer.data() + sizeof(len), time, sizeof(time));
+        if (write(fd, buffer.data(), buffer.size()) != ssize_t(buffer.size())) fail();
+        offset.push_back(end);
+        end += buffer.size();
+    }
+
+    size_t size() const { return offset.size(); }
+
+    /**
+     * whether the file at 'path' is an episode log rather than a saved statistic
+     */
+    static bool detect(const std::string& path) {
+        char head[8] = {};
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        bool match = read(fd, head, 8) == 8 && std::memcmp(head, header_magic, 8) == 0;
+        close(fd);
+        return match;
+    }
+
+private:
+    static bool is_log(const char* base, const size_t& length) {
+        return length >= header && std::memcmp(base, header_magic, 8) == 0;
+    }
+
+    void fail() {
+        std::cerr << "cannot write " << path << std::endl;
+        std::exit(-1);
+    }
+
+    static constexpr uint32_t version = 1;
+    static constexpr size_t header = 16;
+    static constexpr size_t entry_head = sizeof(uint32_t) + sizeof(uint64_t) * 2;
+    static constexpr size_t footer_tail = sizeof(uint64_t) * 2 + 8;
+    static constexpr const char* header_magic = "2584LOG";
+    static constexpr const char* footer_magic = "2584IDX";
+
+    std::string path;
+    int fd;
+    size_t end;
+    std::vector<uint64_t> offset;
+    std::vector<char> buffer;
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+
+#define TILENUMBER 24
+
+/**
+ * compile-time shapes of n-tuple networks, see basic_player
+ *
+ * a network consists of groups, and each group evaluates its tuples on an ordered list of board symmetries
+ *   symmetry 0-3: the board rotated clockwise 0-3 times
+ *   symmetry 4-7: the board reflected horizontally, then rotated clockwise 0-3 times
+ * the features are enumerated group by group, symmetry by symmetry, then tuple by tuple
+ *
+ * all loops below have compile-time bounds and cell positions, so every kernel is unrolled per network
+ */
+
+/**
+ * the cell of the original board which appears at position 'p' of symmetric board 's'
+ */
+constexpr int rotated_cell(const int& k, const int& p) {
+    return k == 0 ? p : rotated_cell(k - 1, (3 - p % 4) * 4 + p / 4);
+}
+constexpr int symmetric_cell(const int& s, const int& p) {
+    return s < 4 ? rotated_cell(s, p) : (rotated_cell(s - 4, p) / 4) * 4 + 3 - rotated_cell(s - 4, p) % 4;
+}
+
+constexpr size_t power(const size_t& base, const size_t& exp) {
+    return exp == 0 ? 1 : base * power(base, exp - 1);
+}
+constexpr size_t total() {
+    return 0;
+}
+template<typename... sizes>
+constexpr size_t total(const size_t& size, const sizes&... rest) {
+    return size + total(rest...);
+}
+
+/**
+ * a flat description of one feature, for kernels which process features in vector lanes instead of unrolled code
+ */
+struct feature {
+    size_t table;
+    size_t length;
+    bool mirror;
+    int cell[8];
+};
+
+/**
+ * a tuple of 'cells' which indexes the weight table 'table'
+ *
+ * a 'mirror' tuple is its own mirror image when cells (0, 1), (2, 3), ... are swapped pairwise,
+ * so it is always read in the canonical order, i.e., the one with (a, c, e, ...) <= (b, d, f, ...)
+ */
+template<size_t table, bool mirror, int... cells>
+struct ntuple {
+    static constexpr size_t weight_table = table;
+    static constexpr size_t length = sizeof...(cells);
+    static_assert(!mirror || length % 2 == 0, "a mirror tuple consists of pairs");
+    static_assert(length <= 8, "a tuple consists of at most 8 cells");
+
+    template<int s>
+    static feature describe() {
+        feature f = { table, length, mirror, { symmetric_cell(s, cells)... } };
+        return f;
+    }
+
+    /**
+     * the index on symmetric board 's', given the tile indices and the merged ones of the original board
+     */
+    template<int radix, int s>
+    static size_t index(const int* tile, const int* part) {
+        static const int pos[] = { symmetric_cell(s, cells)... };
+        size_t m = 0;
+        for (size_t k = 0; mirror && k < length; k += 2) {
+            if (tile[pos[k]] == tile[pos[k + 1]]) continue;
+            m = tile[pos[k]] > tile[pos[k + 1]];
+            break;
+        }
+        size_t entry = 0;
+        for (size_t k = 0; k < length; k++)
+            entry = entry * radix + part[pos[k ^ m]];
+        return entry;
+    }
+};
+
+// definitions for the members bound to references, e.g., by power, which an unoptimized build does not fold away
+template<size_t table, bool mirror, int... cells>
+constexpr size_t ntuple<table, mirror, cells...>::weight_table;
+template<size_t table, bool mirror, int... cells>
+constexpr size_t ntuple<table, mirror, cells...>::length;
+
+template<int... s>
+struct symmetries {};
+
+template<typename symmetry, typename... tuples>
+struct group;
+
+template<int... s, typename... tuples>
+struct group<symmetries<s...>, tuples...> {
+    static constexpr size_t features = sizeof...(s) * sizeof...(tuples);
+
+    template<int radix>
+    static void collect(const int* tile, const int* part, std::pair<size_t, size_t>*& out) {
+        int expand[] = { 0, (collect<radix, s>(tile, part, out), 0)... };
+        (void) expand;
+    }
+
+    template<int radix, int sym>
+    static void collect(const int* tile, const int* part, std::pair<size_t, size_t>*& out) {
+        int expand[] = { 0, (put(out, tuples::weight_table, tuples::template index<radix, sym>(tile, part)), 0)... };
+        (void) expand;
+    }
+
+    static void describe(feature*& out) {
+        int expand[] = { 0, (describe<s>(out), 0)... };
+        (void) expand;
+    }
+
+    template<int sym>
+    static void describe(feature*& out) {
+        int expand[] = { 0, (*out++ = tuples::template describe<sym>(), 0)... };
+        (void) expand;
+    }
+
+    static size_t tables() {
+        size_t num = 0;
+        int expand[] = { 0, (num = std::max<size_t>(num, tuples::weight_table + 1), 0)... };
+        (void) expand;
+        return num;
+    }
+
+    static size_t size(const size_t& table, const size_t& radix) {
+        size_t num = 0;
+        int expand[] = { 0, (num = (tuples::weight_table == table) ? std::max(num, power(radix, tuples::length)) : num, 0)... };
+        (void) expand;
+        return num;
+    }
+
+private:
+    static void put(std::pair<size_t, size_t>*& out, size_t table, size_t index) {
+        out->first = table;
+        out->second = index;
+        out++;
+    }
+};
+
+/**
+ * an n-tuple network over tile indices [0, radix)
+ */
+template<int radix, typename... groups>
+struct network {
+    static constexpr int tiles = radix;
+    static constexpr size_t features = total(groups::features...);
+    typedef std::array<std::pair<size_t, size_t>, features> feature_list;
+
+    /**
+     * gather the (table, index) pairs of all features
+     */
+    static void collect(const int* tile, const int* part, feature_list& list) {
+        std::pair<size_t, size_t>* out = list.data();
+        int expand[] = { 0, (groups::template collect<radix>(tile, part, out), 0)... };
+        (void) expand;
+    }
+
+    /**
+     * all features in the order of collect()
+     */
+    static std::array<feature, features> describe() {
+        std::array<feature, features> list;
+        feature* out = list.data();
+        int expand[] = { 0, (groups::describe(out), 0)... };
+        (void) expand;
+        return list;
+    }
+
+    static size_t tables() {
+        size_t num = 0;
+        int expand[] = { 0, (num = std::max(num, groups::tables()), 0)... };
+        (void) expand;
+        return num;
+    }
+
+    static size_t size(const size_t& table) {
+        size_t num = 0;
+        int expand[] = { 0, (num = std::max(num, groups::size(table, radix)), 0)... };
+        (void) expand;
+        return num;
+    }
+};
+
+/**
+ * the default network, 4 tables of TILENUMBER^6 entries
+ * 3 axe-shaped 6-tuples on all 8 symmetries, and 3 rectangular 6-tuples on the 4 reflected ones
+ *
+ *    outer(a) outer(b) x x
+ *    outer(c) outer(d) x x
+ *    outer(e) outer(f) x x
+ *    xxxxxxxx xxxxxxxx x x
+ *
+ *    x x outer(b) outer(a)
+ *    x x outer(d) outer(c)
+ *    x x outer(f) outer(e)
+ *    x x xxxxxxxx xxxxxxxx
+ *
+ *    x inner(a) inner(b) x
+ *    x inner(c) inner(d) x
+ *    x inner(e) inner(f) x
+ *    x xxxxxxxx xxxxxxxx x
+ */
+typedef network<TILENUMBER,
+    group<symmetries<0, 1, 2, 3, 5, 6, 7, 4>,
+        ntuple<0, false, 0, 1, 2, 3, 6, 7>,
+        ntuple<1, false, 4, 5, 6, 7, 10, 11>,
+        ntuple<1, false, 8, 9, 10, 11, 14, 15>>,
+    group<symmetries<4, 5, 6, 7>,
+        ntuple<2, false, 0, 1, 4, 5, 8, 9>,
+        ntuple<3, true, 1, 2, 5, 6, 9, 10>,
+        ntuple<2, false, 3, 2, 7, 6, 11, 10>>> axe_six;
+
+/**
+ * 8 tables of TILENUMBER^6 entries, 8 distinct 6-tuples on all 8 symmetries
+ */
+typedef network<TILENUMBER,
+    group<symmetries<0, 1, 2, 3, 4, 5, 6, 7>,
+        ntuple<0, false, 0, 1, 2, 3, 4, 5>,
+        ntuple<1, false, 4, 5, 6, 7, 8, 9>,
+        ntuple<2, false, 0, 1, 2, 4, 5, 6>,
+        ntuple<3, false, 4, 5, 6, 8, 9, 10>,
+        ntuple<4, false, 0, 1, 4, 5, 8, 9>,
+        ntuple<5, false, 1, 2, 5, 6, 9, 10>,
+        ntuple<6, false, 0, 1, 2, 3, 6, 7>,
+        ntuple<7, false, 4, 5, 6, 7, 10, 11>>> eight_six;
+
+/**
+ * 4 tables of 16^7 entries, 4 distinct 7-tuples on all 8 symmetries
+ * the radix is reduced to keep each table at 1 GiB, hence the tiles from 987 up share one index
+ */
+typedef network<16,
+    group<symmetries<0, 1, 2, 3, 4, 5, 6, 7>,
+        ntuple<0, false, 0, 1, 2, 3, 4, 5, 6>,
+        ntuple<1, false, 4, 5, 6, 7, 8, 9, 10>,
+        ntuple<2, false, 0, 1, 2, 4, 5, 6, 8>,
+        ntuple<3, false, 0, 1, 4, 5, 8, 9, 12>>> four_seven;
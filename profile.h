@@ -0,0 +1,144 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <x86intrin.h>
+
+/**
+ * opt-in latency histograms of the phases of a move, e.g., '2584 --profile'
+ *
+ * the phases would be
+ *  select:  the player chooses its move, i.e., take_action without the TD update
+ *  extract: the feature indices of a board, which is a part of select
+ *  place:   the environment places a tile
+ *  update:  a TD update of an afterstate, either online in take_action or backward in close_episode
+ *
+ * every thread counts its own samples, timed by the time stamp counter, and show() merges those of all threads
+ * while disabled, a phase costs a load and a branch
+ */
+class profile {
+public:
+    enum phase { select, extract, place, update, phases };
+
+    static bool enabled() { return on(); }
+    static void enable() {
+        calibrate();
+        on() = true;
+    }
+
+    /**
+     * time the enclosing block as a sample of phase 'p'
+     */
+    class scope {
+    public:
+        scope(const phase& p) : p(p), tick(on() ? __rdtsc() : 0) {}
+        ~scope() { if (tick) local().record(p, __rdtsc() - tick); }
+    private:
+        phase p;
+        uint64_t tick;
+    };
+
+    /**
+     * show p50, p99 and p999 of each phase since the last show, or since the start if 'cumulative', e.g.,
+     *        select   p50 = 412 ns, p99 = 1.9 us, p999 = 6.1 us (1290311)
+     */
+    static void show(const bool& cumulative = false) {
+        static const char* name[] = { "select", "extract", "place", "update" };
+        std::lock_guard<std::mutex> guard(lock());
+        for (int p = 0; p < phases; p++) {
+            uint64_t count[buckets] = {}, total = 0;
+            for (const std::shared_ptr<histogram>& h : registry()) {
+                for (int b = 0; b < buckets; b++) {
+                    uint64_t now = h->count[p][b].load(std::memory_order_relaxed);
+                    if (cumulative) {
+                        count[b] += now;
+                        continue;
+                    }
+                    count[b] += now - h->last[p][b];
+                    h->last[p][b] = now;
+                }
+            }
+            for (int b = 0; b < buckets; b++) total += count[b];
+            if (total == 0) continue;
+            std::cout << "\t" << name[p] << "\t";
+            const double rank[] = { 0.5, 0.99, 0.999 };
+            const char* label[] = { "p50", "p99", "p999" };
+            for (int q = 0; q < 3; q++) {
+                uint64_t need = std::max<uint64_t>(uint64_t(rank[q] * total + 0.5), 1), seen = 0;
+                int b = 0;
+                while ((seen += count[b]) < need) b++;
+                std::cout << (q ? ", " : "") << label[q] << " = " << pretty((lower(b) + lower(b + 1)) / 2.0 / rate());
+            }
+            std::cout << " (" << total << ")" << std::endl;
+        }
+    }
+
+private:
+    /**
+     * log-linear buckets, 8 per power of two, i.e., within 12.5% of the value
+     */
+    static constexpr int buckets = 512;
+    static int bucket(const uint64_t& x) {
+        if (x < 8) return int(x);
+        int e = 63 - __builtin_clzll(x);
+        return (e - 2) * 8 + int((x >> (e - 3)) & 7);
+    }
+    static double lower(const int& b) {
+        return b < 8 ? b : double(8 + b % 8) * double(uint64_t(1) << (b / 8 - 1));
+    }
+
+    /**
+     * the counts are written by their own thread only, so relaxed loads and stores suffice
+     * 'last' is the count of the last show(), so that show() never writes what another thread counts
+     */
+    struct histogram {
+        std::atomic<uint64_t> count[phases][buckets];
+        uint64_t last[phases][buckets];
+
+        void record(const phase& p, const uint64_t& ticks) {
+            std::atomic<uint64_t>& c = count[p][bucket(ticks)];
+            c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    };
+
+    static histogram& local() {
+        static thread_local histogram* h = nullptr;
+        if (h) return *h;
+        std::shared_ptr<histogram> own = std::make_shared<histogram>();
+        std::lock_guard<std::mutex> guard(lock());
+        registry().push_back(own);
+        return *(h = own.get());
+    }
+
+    /**
+     * the ticks of the time stamp counter per nanosecond, measured against steady_clock
+     */
+    static void calibrate() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t tick = __rdtsc();
+        while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+        uint64_t tock = __rdtsc();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        rate() = (tock - tick) / ns;
+    }
+
+    static std::string pretty(const double& ns) {
+        char buf[32];
+        if (ns < 1000) snprintf(buf, sizeof(buf), "%.0f ns", ns);
+        else if (ns < 1000000) snprintf(buf, sizeof(buf), "%.1f us", ns / 1000);
+        else snprintf(buf, sizeof(buf), "%.1f ms", ns / 1000000);
+        return buf;
+    }
+
+    static bool& on() { static bool flag = false; return flag; }
+    static double& rate() { static double r = 1; return r; }
+    static std::mutex& lock() { static std::mutex m; return m; }
+    static std::vector<std::shared_ptr<histogram>>& registry() { static std::vector<std::shared_ptr<histogram>> list; return list; }
+};
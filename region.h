@@ -0,0 +1,218 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include "weight.h"
+#include "codec.h"
+
+/**
+ * weight tables in named shared memory (/dev/shm/NAME), trained lock-free by several processes at once,
+ * exactly as threads train the tables of one process (see weight::update)
+ *
+ * the layout would be
+ *   header: "2584SHM" '\0', state (uint32), count of tables (uint32), pid of the coordinator (uint64),
+ *           size of every table (uint64 x count), padding to 4 KiB
+ *   image:  the tables in the same layout as a weight file, so that weight::refer reads them in place
+ *
+ * one process, the coordinator, creates the region, fills it from a weight file or with zeros under an exclusive flock,
+ * and marks it ready; the others attach to it, waiting until it is ready
+ * every attached process holds a shared flock on the region, which the kernel drops when the process exits, even by a crash;
+ * at teardown the coordinator marks the region closing and takes the exclusive flock, i.e., waits until the others have left,
+ * so that its final save includes all their updates, then removes the name
+ *
+ * note that the pages of a region are shared rather than copy-on-write, so a checkpoint of the coordinator (see checkpoint)
+ * sees the updates of the other processes while it writes, i.e., every entry is consistent but the tables as a whole are not
+ * also note that every process should seed its environment differently, e.g., --evil="seed=N", or they play the same games
+ */
+class region {
+public:
+    /**
+     * create 'name' for tables of 'sizes', as the coordinator, from the weight file 'load' or from zeros if it is empty
+     * a compressed weight file must have been saved from 'network', see codec
+     * a region left by a crashed coordinator, i.e., one which no process holds and whose coordinator is gone, is reused
+     */
+    static std::shared_ptr<region> create(const std::string& name, const std::vector<size_t>& sizes, const std::string& load,
+                                          const std::string& network) {
+        std::string path = "/" + name;
+        int fd;
+        struct stat st;
+        for (;;) {
+            // the exclusive flock is taken before anything is decided, so a region which is being filled is never touched
+            fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0600);
+            if (fd == -1) fail(name, "cannot be created");
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0) fail(name, "is in use by other processes");
+            if (fstat(fd, &st) != 0) fail(name, "cannot be inspected");
+            if (st.st_nlink) break;
+            close(fd); // its coordinator has just removed it
+        }
+        // no other process holds it, so it is either new or left by a crashed coordinator, unless its coordinator is alive
+        // but between flocks, i.e., after filling it or while draining it
+        uint64_t pid = 0;
+        if (size_t(st.st_size) >= header && pread(fd, &pid, sizeof(pid), 16) == sizeof(pid) && alive(pid))
+            fail(name, "is in use by other processes");
+
+        size_t length = header;
+        for (size_t size : sizes) length += sizeof(size_t) + sizeof(float) * size;
+        length += sizeof(size_t);
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0) fail(name, "cannot be sized");
+        std::shared_ptr<region> r(new region(name, fd, length, true));
+        char* base = r->file.get();
+        std::memcpy(base, magic, 8);
+        uint32_t count = sizes.size();
+        std::memcpy(base + 12, &count, sizeof(count));
+        pid = getpid();
+        std::memcpy(base + 16, &pid, sizeof(pid));
+        std::memcpy(base + 24, sizes.data(), sizeof(uint64_t) * count);
+
+        // the image: count, then every table as its length and entries, which stay zero unless loaded
+        size_t num = sizes.size(), offset = header;
+        std::memcpy(base + offset, &num, sizeof(num));
+        offset += sizeof(size_t);
+        for (size_t size : sizes) {
+            std::memcpy(base + offset, &size, sizeof(size));
+            offset += sizeof(size_t) + sizeof(float) * size;
+        }
+        std::vector<weight> list = r->tables();
+        if (load.size() && codec::detect(load)) {
+            codec::read(load, list, network, std::thread::hardware_concurrency());
+        } else if (load.size()) {
+            size_t at = sizeof(size_t), limit = 0;
+            std::shared_ptr<char> source = weight::map(load, limit, false);
+            for (weight& w : list) {
+                size_t len = 0;
+                if (at + sizeof(size_t) <= limit) std::memcpy(&len, source.get() + at, sizeof(len));
+                if (len != w.size() || at + sizeof(size_t) + sizeof(float) * len > limit) fail(name, "does not match " + load);
+                std::memcpy(&w[0], source.get() + at + sizeof(size_t), sizeof(float) * len);
+                at += sizeof(size_t) + sizeof(float) * len;
+            }
+        }
+        r->state()->store(ready, std::memory_order_release);
+        if (flock(fd, LOCK_SH) != 0) fail(name, "cannot be locked");
+        return r;
+    }
+
+    /**
+     * attach to 'name', waiting up to 'timeout' seconds for its coordinator to make it ready
+     * a region whose coordinator is gone is left alone, as if it were being built, so that a new coordinator can replace it
+     */
+    static std::shared_ptr<region> attach(const std::string& name, const std::vector<size_t>& sizes, const double& timeout = 60) {
+        std::string path = "/" + name;
+        auto start = std::chrono::steady_clock::now();
+        auto wait = [&]() {
+            if (std::chrono::steady_clock::now() - start > std::chrono::duration<double>(timeout))
+                fail(name, "is not ready; is its coordinator running?");
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        };
+        // the coordinator holds the exclusive flock from sizing the region until it is ready
+        int fd;
+        struct stat st;
+        for (;; wait()) {
+            if ((fd = shm_open(path.c_str(), O_RDWR, 0600)) == -1) continue;
+            if (fstat(fd, &st) != 0) fail(name, "cannot be inspected");
+            uint32_t state = building;
+            uint64_t pid = 0;
+            if (size_t(st.st_size) >= header && flock(fd, LOCK_SH | LOCK_NB) == 0) {
+                if (fstat(fd, &st) != 0) fail(name, "cannot be inspected");
+                if (pread(fd, &state, sizeof(state), 8) != sizeof(state) || pread(fd, &pid, sizeof(pid), 16) != sizeof(pid))
+                    state = building;
+                if (state != building && alive(pid)) break;
+            }
+            close(fd); // which drops the flock, if any
+        }
+        std::shared_ptr<region> r(new region(name, fd, st.st_size, false));
+        if (r->state()->load(std::memory_order_acquire) != ready) fail(name, "is closing");
+
+        const char* base = r->file.get();
+        uint32_t count = 0;
+        std::memcpy(&count, base + 12, sizeof(count));
+        bool match = std::memcmp(base, magic, 8) == 0 && count == sizes.size();
+        for (size_t i = 0; match && i < count; i++) {
+            uint64_t size;
+            std::memcpy(&size, base + 24 + sizeof(uint64_t) * i, sizeof(size));
+            match = size == sizes[i];
+        }
+        if (!match) fail(name, "does not match the network");
+        return r;
+    }
+
+    region(const region&) = delete;
+    region& operator =(const region&) = delete;
+
+    /**
+     * leave the region, and remove its name if this is the coordinator
+     * the mapping itself lives on as long as the tables referring to it
+     */
+    ~region() {
+        if (owner) shm_unlink(("/" + name).c_str());
+        close(fd);
+    }
+
+    /**
+     * the tables, which refer to the region in place
+     */
+    std::vector<weight> tables() const {
+        std::vector<weight> list;
+        size_t count = 0, offset = header + sizeof(size_t);
+        std::memcpy(&count, file.get() + header, sizeof(count));
+        for (size_t i = 0; i < count; i++)
+            list.push_back(weight::refer(file, length, offset));
+        return list;
+    }
+
+    /**
+     * the coordinator's teardown: refuse new processes, and wait for the attached ones to leave
+     */
+    void drain() {
+        if (!owner) return;
+        state()->store(closing, std::memory_order_release);
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) return;
+        std::cerr << "waiting for other processes to leave " << name << std::endl;
+        while (flock(fd, LOCK_EX) != 0 && errno == EINTR);
+    }
+
+private:
+    region(const std::string& name, const int& fd, const size_t& length, const bool& owner)
+        : name(name), fd(fd), length(length), owner(owner) {
+        void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) fail(name, "cannot be mapped");
+        size_t size = length;
+        file.reset(static_cast<char*>(addr), [size](char* p) { munmap(p, size); });
+    }
+
+    std::atomic<uint32_t>* state() const { return reinterpret_cast<std::atomic<uint32_t>*>(file.get() + 8); }
+
+    /**
+     * whether the process 'pid', e.g., the coordinator of a region, is running
+     */
+    static bool alive(const uint64_t& pid) {
+        return pid && (kill(pid_t(pid), 0) == 0 || errno == EPERM);
+    }
+
+    static void fail(const std::string& name, const std::string& why) {
+        std::cerr << "shared memory " << name << " " << why << std::endl;
+        std::exit(-1);
+    }
+
+    static constexpr size_t header = 4096;
+    static constexpr const char* magic = "2584SHM";
+    enum { building = 0, ready = 1, closing = 2 };
+
+    std::string name;
+    int fd;
+    size_t length;
+    bool owner;
+    std::shared_ptr<char> file;
+};
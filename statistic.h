@@ -1,5 +1,6 @@
 #pragma once
 #include <list>
+#include <deque>
 #include <vector>
 #include <algorithm>
 #include <iostream>
@@ -8,6 +9,8 @@
 #include "board.h"
 #include "action.h"
 #include "agent.h"
+#include "journal.h"
+#include "profile.h"
 
 class statistic {
 public:
@@ -15,14 +18,18 @@ public:
     * the total episodes to run
     * the block size of statistic
     * the limit of saving records
+    * whether the actions of the saved records are kept, e.g., for writing them out
     *
     * note that total >= limit >= block
+    * the results of episodes (score, max tile, ...) are accumulated while playing, so show() never replays actions
     */
-    statistic(const size_t& total, const size_t& block = 0, const size_t& limit = 0)
+    statistic(const size_t& total, const size_t& block = 0, const size_t& limit = 0, const bool& keep = true)
           : total(total),
             block(block ? block : this->total),
             limit(std::max(limit, this->block)),
-            count(0) {}
+            keep(keep),
+            count(0),
+            log(nullptr) {}
 
 public:
     /**
@@ -45,46 +52,42 @@ public:
      *  '93.7%': 93.7% (937 games) reached 8192-tiles in saved games (a.k.a. win rate of 8192-tile)
      *  '22.4%': 22.4% (224 games) terminated with 8192-tiles (the largest) in saved games
      */
-    void show() const {
-        int block = std::min(data.size(), this->block);
-        size_t sum = 0, max = 0, opc = 0, stat[32] = { 0 };
-        uint64_t duration = 0;
-        auto it = data.end();
-        for (int i = 0; i < block; i++) {
-            auto& path = *(--it);
-            board game;
-            size_t score = 0;
-            for (const action& move : path)
-                score += move.apply(game);
-            sum += score;
-            max = std::max(score, max);
-            opc += (path.size() - 2) / 2;
-            int tile = 0;
-            for (int i = 0; i < 16; i++)
-                tile = std::max(tile, game(i));
-            stat[tile]++;
-            duration += (path.tock_time() - path.tick_time());
-        }
-        float avg = float(sum) / block;
-        float coef = 100.0 / block;
-        float ops = opc * 1000.0 / duration;
-        std::cout << count << "\t";
-        std::cout << "avg = " << unsigned(avg) << ", ";
-        std::cout << "max = " << unsigned(max) << ", ";
-        std::cout << "ops = " << unsigned(ops) << std::endl;
-        for (int t = 0, c = 0; c < block; c += stat[t++]) {
-            if (stat[t] == 0) continue;
-            int accu = std::accumulate(stat + t, stat + 32, 0);
-            std::cout << "\t" << i2t[t] << "\t" << (accu * coef) << "%";
-            std::cout << "\t(" << (stat[t] * coef) << "%)" << std::endl;
-        }
+    void show(const bool& cumulative = false) const {
+        print(std::to_string(count), tabulate(results.end() - std::min(results.size(), this->block), results.end()));
+        if (profile::enabled()) profile::show(cumulative);
         std::cout << std::endl;
     }
 
+    /**
+     * show the difference of all saved games against those of a baseline, e.g., the same seeds played by another player
+     *
+     * the format would be
+     * diff   avg = +1523 (+0.6%), max = -2584
+     *        4096    +0.4%
+     *        8192    -1.2%
+     *
+     * where the percentages of tiles are the differences of win rates
+     */
+    void compare(const statistic& base) const {
+        tally sum = tabulate(results.begin(), results.end()), ref = tabulate(base.results.begin(), base.results.end());
+        double avg = double(sum.score) / sum.block, ref_avg = double(ref.score) / ref.block;
+        std::cout << std::showpos;
+        std::cout << "diff\t";
+        std::cout << "avg = " << int64_t(avg - ref_avg) << " (" << float((avg - ref_avg) * 100 / ref_avg) << "%), ";
+        std::cout << "max = " << (int64_t(sum.max) - int64_t(ref.max)) << std::endl;
+        for (size_t t = 0; t < 32; t++) {
+            if (sum.stat[t] == 0 && ref.stat[t] == 0) continue;
+            double rate = std::accumulate(sum.stat + t, sum.stat + 32, size_t(0)) * 100.0 / sum.block;
+            double ref_rate = std::accumulate(ref.stat + t, ref.stat + 32, size_t(0)) * 100.0 / ref.block;
+            std::cout << "\t" << std::noshowpos << i2t[t] << "\t" << std::showpos << (rate - ref_rate) << "%" << std::endl;
+        }
+        std::cout << std::noshowpos << std::endl;
+    }
+
     void summary() const {
         auto block_temp = block;
-        const_cast<statistic&>(*this).block = data.size();
-        show();
+        const_cast<statistic&>(*this).block = results.size();
+        show(true);
         const_cast<statistic&>(*this).block = block_temp;
     }
 
@@ -92,27 +95,85 @@ public:
         return count >= total;
     }
 
+    size_t episodes() const {
+        return count;
+    }
+
+    /**
+     * append every episode to 'log' as it closes, see journal
+     * the actions of each episode are needed, so the per-thread statistics should keep them
+     */
+    void stream(journal& log) {
+        this->log = &log;
+    }
+
+    /**
+     * continue after the episodes of a log, e.g., one left by an interrupted run
+     */
+    void resume(const journal::view& log) {
+        if (log.size() >= total) // nothing left to play, so show all of them, as operator >> does
+            total = block = limit = log.size();
+        for (size_t i = 0; i < log.size(); i++) {
+            journal::episode e = log[i];
+            record rec = e.actions();
+            drop();
+            results.push_back(replay(rec, e.time));
+            if (keep) data.push_back(std::move(rec));
+        }
+    }
+
     void open_episode(const std::string& flag = "") {
-        if (count++ >= limit) data.pop_front();
-        data.emplace_back();
-        data.back().tick();
+        drop();
+        results.emplace_back();
+        results.back().time[0] = milli();
+        if (keep) data.emplace_back();
     }
 
-    void close_episode(const std::string& flag = "") {
-        data.back().tock();
+    /**
+     * close the episode which ended on 'game'
+     */
+    void close_episode(const std::string& flag, const board& game) {
+        results.back().tile = largest(game);
+        results.back().time[1] = milli();
+        if (keep) data.back().shrink_to_fit();
+        if (keep && log) log->append(data.back(), results.back().time);
         if (count % block == 0) show();
     }
 
+    /**
+     * move the closed episodes of a per-thread statistic into this one, showing whenever a block completes
+     * the per-thread statistic should be constructed with total = -1, so that it neither shows nor drops records
+     */
+    void merge(statistic& local) {
+        while (local.results.size()) {
+            drop();
+            if (log && local.data.size()) log->append(local.data.front(), local.results.front().time);
+            results.push_back(local.results.front());
+            local.results.pop_front();
+            if (keep && local.data.size())
+                data.splice(data.end(), local.data, local.data.begin());
+            else if (local.data.size())
+                local.data.pop_front();
+            if (count % block == 0) show();
+        }
+    }
+
     board make_empty_board() {
         return {};
     }
 
-    void save_action(const action& move) {
-        data.back().push_back(move);
+    /**
+     * count an action which has been applied by the caller and earned 'reward'
+     */
+    void save_action(const action& move, const int& reward) {
+        result& last = results.back();
+        last.score += reward;
+        last.moves++;
+        if (keep) data.back().push_back(move);
     }
 
     agent& take_turns(agent& play, agent& evil) {
-        return (std::max(data.back().size() + 1, size_t(2)) % 2) ? play : evil;
+        return (std::max(results.back().moves + 1, size_t(2)) % 2) ? play : evil;
     }
 
     agent& last_turns(agent& play, agent& evil) {
@@ -122,7 +183,16 @@ public:
     friend std::ostream& operator <<(std::ostream& out, const statistic& stat) {
         auto size = stat.data.size();
         out.write(reinterpret_cast<char*>(&size), sizeof(size));
-        for (const record& rec : stat.data) out << rec;
+        auto it = stat.results.end() - size;
+        for (const record& rec : stat.data) {
+            auto size = rec.size();
+            out.write(reinterpret_cast<char*>(&size), sizeof(size));
+            for (const action& act : rec) {
+                short opcode = int(act);
+                out.write(reinterpret_cast<const char*>(&opcode), sizeof(opcode));
+            }
+            out.write(reinterpret_cast<const char*>((it++)->time), sizeof(uint64_t) * 2);
+        }
         return out;
     }
 
@@ -130,56 +200,137 @@ public:
         auto size = stat.data.size();
         in.read(reinterpret_cast<char*>(&size), sizeof(size));
         stat.total = stat.block = stat.limit = stat.count = size;
-        stat.data.resize(size);
-        for (record& rec : stat.data) in >> rec;
+        stat.results.clear();
+        stat.data.clear();
+        for (size_t i = 0; i < size; i++) {
+            record rec;
+            uint64_t time[2];
+            auto length = rec.size();
+            in.read(reinterpret_cast<char*>(&length), sizeof(length));
+            std::vector<short> opcode(length);
+            in.read(reinterpret_cast<char*>(opcode.data()), sizeof(short) * length);
+            rec.assign(opcode.begin(), opcode.end());
+            in.read(reinterpret_cast<char*>(time), sizeof(time));
+            stat.results.push_back(replay(rec, time));
+            if (stat.keep) stat.data.push_back(std::move(rec));
+        }
         return in;
     }
 
-private:
-    class record : public std::vector<action> {
-    public:
-        record() { reserve(32768); }
-        void tick() { time[0] = milli(); }
-        void tock() { time[1] = milli(); }
-        uint64_t tick_time() const { return time[0]; }
-        uint64_t tock_time() const { return time[1]; }
-
-        friend std::ostream& operator <<(std::ostream& out, const record& rec) {
-            auto size = rec.size();
-            auto time = rec.time;
-            out.write(reinterpret_cast<char*>(&size), sizeof(size));
-            for (const action& act : rec) {
-                short opcode = int(act);
-                out.write(reinterpret_cast<const char*>(&opcode), sizeof(opcode));
-            }
-            out.write(reinterpret_cast<const char*>(time), sizeof(time[0]) * 2);
-            return out;
+    /**
+     * the result of an episode, accumulated action by action
+     */
+    struct result {
+        int tile = 0; // the largest tile at the end
+        size_t score = 0;
+        size_t moves = 0; // the number of actions, of both the player and the environment
+        uint64_t time[2] = {};
+    };
+
+    /**
+     * totals of a number of results
+     */
+    struct tally {
+        size_t block, score, max, opc, stat[32];
+        uint64_t duration;
+    };
+
+    /**
+     * sum up the results in [first, last)
+     */
+    template<typename iterator>
+    static tally tabulate(iterator first, iterator last) {
+        tally sum = {};
+        sum.block = last - first;
+        std::vector<std::pair<uint64_t, uint64_t>> period;
+        for (auto it = first; it != last; it++) {
+            sum.score += it->score;
+            sum.max = std::max(it->score, sum.max);
+            sum.opc += (it->moves - 2) / 2;
+            sum.stat[it->tile]++;
+            period.emplace_back(it->time[0], it->time[1]);
         }
-        friend std::istream& operator >>(std::istream& in, record& rec) {
-            auto size = rec.size();
-            auto time = rec.time;
-            in.read(reinterpret_cast<char*>(&size), sizeof(size));
-            rec.reserve(size);
-            for (size_t i = 0; i < size; i++) {
-                short opcode;
-                in.read(reinterpret_cast<char*>(&opcode), sizeof(opcode));
-                rec.emplace_back(int(opcode));
-            }
-            in.read(reinterpret_cast<char*>(time), sizeof(time[0]) * 2);
-            return in;
+        // episodes played by parallel threads overlap, so count the union of their periods only once
+        std::sort(period.begin(), period.end());
+        for (uint64_t i = 0, last = 0; i < period.size(); i++) {
+            uint64_t tick = std::max(period[i].first, last), tock = period[i].second;
+            if (tock > tick) sum.duration += tock - tick;
+            last = std::max(last, tock);
         }
+        return sum;
+    }
 
-    private:
-        uint64_t milli() const {
-            auto now = std::chrono::system_clock::now().time_since_epoch();
-            return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    /**
+     * print the totals of a tally under 'label', in the format of show(), e.g., for analyze
+     */
+    static void print(const std::string& label, const tally& sum) {
+        float avg = float(sum.score) / sum.block;
+        float coef = 100.0 / sum.block;
+        float ops = sum.opc * 1000.0 / sum.duration;
+        std::cout << label << "\t";
+        std::cout << "avg = " << unsigned(avg) << ", ";
+        std::cout << "max = " << unsigned(sum.max) << ", ";
+        std::cout << "ops = " << unsigned(ops) << std::endl;
+        for (size_t t = 0, c = 0; c < sum.block; c += sum.stat[t++]) {
+            if (sum.stat[t] == 0) continue;
+            size_t accu = std::accumulate(sum.stat + t, sum.stat + 32, size_t(0));
+            std::cout << "\t" << i2t[t] << "\t" << (accu * coef) << "%";
+            std::cout << "\t(" << (sum.stat[t] * coef) << "%)" << std::endl;
         }
-        uint64_t time[2];
-    };
+    }
+
+    /**
+     * the largest tile of 'game'
+     */
+    static int largest(const board& game) {
+        int tile = 0;
+        for (int i = 0; i < 16; i++)
+            tile = std::max(tile, game.at(i));
+        return tile;
+    }
+
+private:
+    /**
+     * the actions of an episode, kept only if the statistic is to be written out
+     */
+    typedef std::vector<action> record;
+
+    /**
+     * rebuild the result of a loaded record
+     */
+    static result replay(const record& rec, const uint64_t (&time)[2]) {
+        result last;
+        board game;
+        for (const action& move : rec) {
+            last.score += std::max(move.apply(game), 0);
+            last.moves++;
+        }
+        last.tile = largest(game);
+        last.time[0] = time[0];
+        last.time[1] = time[1];
+        return last;
+    }
+
+    /**
+     * count a new episode, dropping the oldest one beyond the limit
+     */
+    void drop() {
+        if (count++ < limit) return;
+        results.pop_front();
+        if (data.size()) data.pop_front();
+    }
+
+    static uint64_t milli() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    }
 
     size_t total;
     size_t block;
     size_t limit;
+    bool keep;
     size_t count;
+    std::deque<result> results;
     std::list<record> data;
+    journal* log;
 };
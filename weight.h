@@ -5,6 +5,22 @@
 #include <sstream>
 #include <iterator>
 #include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 /**
  * weight table of n-tuple network
@@ -12,22 +28,81 @@
 class weight {
 public:
     weight() : length(0), value(nullptr) {}
-    weight(const size_t& len) : length(len), value(alloc(len)) {}
-    weight(weight&& f) : length(f.length), value(f.value) { f.value = nullptr; }
+    weight(const size_t& len) : length(len), value(alloc(len)), holder(own(value, len)) {}
+
+    /**
+     * a sparse table of 'len' entries, whose indices consist of 'digits' tile indices in base 'radix'
+     * entries whose tiles are all below 'dense' are stored densely, the others in a hash of 2^'bits' slots,
+     * so that the tile combinations which never occur take no memory
+     */
+    weight(const size_t& len, const int& radix, const int& digits, const int& dense, const int& bits)
+        : length(len), value(alloc(power(dense, digits))), holder(own(value, power(dense, digits))),
+          tail(std::make_shared<hashed>(len, radix, digits, dense, bits)) {}
+
+    weight(weight&& f) : length(f.length), value(f.value), holder(std::move(f.holder)), tail(std::move(f.tail)) { f.value = nullptr; }
+    weight& operator =(weight&& f) {
+        length = f.length;
+        value = f.value;
+        holder = std::move(f.holder);
+        tail = std::move(f.tail);
+        f.value = nullptr;
+        return *this;
+    }
     weight(const weight& f) = delete;
     weight& operator =(const weight& f) = delete;
-    virtual ~weight() { delete[] value; }
+    virtual ~weight() {}
 
+    /**
+     * direct access, for dense tables only
+     */
     float& operator[] (const size_t& i) { return value[i]; }
     const float& operator[] (const size_t& i) const { return value[i]; }
     size_t size() const { return length; }
+    bool sparse() const { return tail != nullptr; }
+
+    /**
+     * a weight which refers to the same table, e.g., for another training thread
+     */
+    weight view() const { return weight(value, length, holder, tail); }
+
+    /**
+     * relaxed atomic access, so that several threads may train the same table without locks (Hogwild!)
+     * concurrent updates of the same entry may be lost, which TD learning tolerates
+     * on x86 these are plain loads and stores
+     */
+    float load(const size_t& i) const {
+        const float* entry = tail ? tail->find(value, i) : value + i;
+        float v = 0;
+        if (entry) __atomic_load(entry, &v, __ATOMIC_RELAXED);
+        return v;
+    }
+    void update(const size_t& i, const float& delta) {
+        float* entry = tail ? tail->insert(value, i) : value + i;
+        if (!entry) return;
+        float v;
+        __atomic_load(entry, &v, __ATOMIC_RELAXED);
+        v += delta;
+        __atomic_store(entry, &v, __ATOMIC_RELAXED);
+    }
+    void prefetch(const size_t& i) const { __builtin_prefetch(tail ? tail->locate(value, i) : value + i); }
 
 public:
     friend std::ostream& operator <<(std::ostream& out, const weight& w) {
         float* value = w.value;
         size_t size = w.size();
         out.write(reinterpret_cast<char*>(&size), sizeof(size_t));
-        out.write(reinterpret_cast<char*>(value), sizeof(float) * size);
+        if (!w.sparse()) {
+            out.write(reinterpret_cast<char*>(value), sizeof(float) * size);
+            return out;
+        }
+        // a sparse table is written densely, so that the file does not depend on how it was stored
+        std::vector<float> chunk(1 << 16);
+        for (size_t i = 0; i < size; i += chunk.size()) {
+            size_t num = std::min(chunk.size(), size - i);
+            for (size_t k = 0; k < num; k++)
+                chunk[k] = w.load(i + k);
+            out.write(reinterpret_cast<char*>(chunk.data()), sizeof(float) * num);
+        }
         return out;
     }
 
@@ -40,6 +115,7 @@ public:
         }
         if (in.read(reinterpret_cast<char*>(&size), sizeof(size_t))) {
             value = alloc(size);
+            w.holder = own(value, size);
             in.read(reinterpret_cast<char*>(value), sizeof(float) * size);
         }
         if (!in) {
@@ -49,21 +125,374 @@ public:
         return in;
     }
 
+public:
+    /**
+     * map a whole file into memory instead of reading it
+     * a read-only mapping is shared with the page cache (and with other processes mapping the same file),
+     * while a writable one is private copy-on-write, so that training never modifies the file
+     * an empty file maps to nothing, which callers find too short
+     * 'advice' is the expected access pattern, e.g., MADV_SEQUENTIAL for files read from start to end
+     */
+    static std::shared_ptr<char> map(const std::string& path, size_t& size, const bool& writable, const int& advice = MADV_RANDOM) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            std::cerr << "cannot open " << path << std::endl;
+            std::exit(-1);
+        }
+        size = st.st_size;
+        void* addr = size ? mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                 writable ? MAP_PRIVATE : MAP_SHARED, fd, 0) : nullptr;
+        close(fd);
+        if (!addr) return nullptr;
+        if (addr == MAP_FAILED) {
+            std::cerr << "cannot map " << path << std::endl;
+            std::exit(-1);
+        }
+        madvise(addr, size, advice);
+        return std::shared_ptr<char>(static_cast<char*>(addr), [size](char* p) { munmap(p, size); });
+    }
+
+    /**
+     * refer to a table stored at 'offset' of a mapped file, in the same layout as operator <<
+     * the offset is advanced to the next table
+     */
+    static weight refer(const std::shared_ptr<char>& file, const size_t& size, size_t& offset) {
+        size_t len = 0;
+        if (offset + sizeof(size_t) <= size)
+            std::memcpy(&len, file.get() + offset, sizeof(size_t));
+        if (offset + sizeof(size_t) > size || len > (size - offset - sizeof(size_t)) / sizeof(float)) {
+            std::cerr << "unexpected end of binary" << std::endl;
+            std::exit(1);
+        }
+        float* value = reinterpret_cast<float*>(file.get() + offset + sizeof(size_t));
+        offset += sizeof(size_t) + sizeof(float) * len;
+        return weight(value, len, file);
+    }
+
+    /**
+     * write the tables as a whole weight file with plain system calls and without allocation,
+     * so that it is safe in a child forked from a multithreaded process, see checkpoint
+     */
+    static bool dump(const int& fd, const std::vector<weight>& tables) {
+        size_t size = tables.size();
+        bool ok = put(fd, &size, sizeof(size));
+        for (size_t t = 0; ok && t < size; t++) {
+            const weight& w = tables[t];
+            ok = put(fd, &w.length, sizeof(w.length));
+            if (!w.sparse()) {
+                ok = ok && put(fd, w.value, sizeof(float) * w.length);
+                continue;
+            }
+            float chunk[4096];
+            for (size_t i = 0; ok && i < w.length; i += 4096) {
+                size_t num = std::min<size_t>(4096, w.length - i);
+                for (size_t k = 0; k < num; k++)
+                    chunk[k] = w.load(i + k);
+                ok = put(fd, chunk, sizeof(float) * num);
+            }
+        }
+        return ok;
+    }
+
+    /**
+     * write all of 'data' to 'fd', resuming interrupted or partial writes
+     */
+    static bool put(const int& fd, const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size) {
+            ssize_t n = write(fd, p, std::min<size_t>(size, 1 << 30));
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
 protected:
+    friend class qweight; // which allocates its tables likewise
+
+    /**
+     * the sparse part of a table, an open-addressing hash with linear probing
+     * slots are claimed by compare-and-swap, so that Hogwild! threads may insert concurrently
+     * slots are never freed; once 3/4 of them are taken, updates of new entries are dropped
+     */
+    class hashed {
+    public:
+        hashed(const size_t& len, const int& radix, const int& digits, const int& dense, const int& bits)
+            : radix(radix), digits(digits), dense(dense), mask((size_t(1) << bits) - 1), used(0) {
+            if (len >= (uint64_t(1) << 31) || digits < 1 || digits > 8 || bits < 1 || bits > 32 || dense < 1 || dense > radix) {
+                std::cerr << "invalid sparse table" << std::endl;
+                std::exit(1);
+            }
+            int width = 0;
+            while ((uint64_t(1) << width) < len) width++;
+            for (size_t k = 0, divisor = 1; k <= this->digits; k++, divisor *= this->radix) {
+                shift[k] = width;
+                while ((uint64_t(1) << (shift[k] - width)) < divisor) shift[k]++;
+                magic[k] = ((uint64_t(1) << shift[k]) / divisor) + 1;
+            }
+            slots = reinterpret_cast<slot*>(alloc(2 * (mask + 1)));
+            holder = own(reinterpret_cast<float*>(slots), 2 * (mask + 1));
+        }
+
+        const float* find(const float* value, const size_t& i) const {
+            size_t d = fold(i);
+            if (d != npos) return value + d;
+            uint32_t key = i + 1;
+            for (size_t h = home(i), n = 0; n <= mask; h = (h + 1) & mask, n++) {
+                uint32_t k = __atomic_load_n(&slots[h].key, __ATOMIC_ACQUIRE);
+                if (k == key) return &slots[h].value;
+                if (k == 0) break;
+            }
+            return nullptr;
+        }
+
+        float* insert(float* value, const size_t& i) {
+            size_t d = fold(i);
+            if (d != npos) return value + d;
+            uint32_t key = i + 1;
+            for (size_t h = home(i), n = 0; n <= mask; h = (h + 1) & mask, n++) {
+                uint32_t k = __atomic_load_n(&slots[h].key, __ATOMIC_ACQUIRE);
+                if (k == 0) {
+                    if (used >= (mask + 1) / 4 * 3) {
+                        if (!__atomic_exchange_n(&full, true, __ATOMIC_RELAXED))
+                            std::cerr << "sparse table full, updates of new entries are dropped" << std::endl;
+                        return nullptr;
+                    }
+                    if (__atomic_compare_exchange_n(&slots[h].key, &k, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        __atomic_add_fetch(&used, 1, __ATOMIC_RELAXED);
+                        return &slots[h].value;
+                    }
+                }
+                if (k == key) return &slots[h].value;
+            }
+            return nullptr;
+        }
+
+        const void* locate(const float* value, const size_t& i) const {
+            size_t d = fold(i);
+            return d != npos ? static_cast<const void*>(value + d) : static_cast<const void*>(slots + home(i));
+        }
+
+    private:
+        /**
+         * the position of entry 'i' in the dense region, or npos if any of its tiles is not below 'dense'
+         * the k-th tile is i / radix^k % radix, where each division is a multiplication with a reciprocal,
+         * exact for indices below 2^width (see the constructor) and independent of the others
+         */
+        size_t fold(const size_t& i) const {
+            size_t q[9];
+            for (size_t k = 0; k <= digits; k++)
+                q[k] = (i * magic[k]) >> shift[k];
+            size_t d = 0, scale = 1;
+            bool low = true;
+            for (size_t k = 0; k < digits; k++) {
+                size_t r = q[k] - q[k + 1] * radix;
+                low = low && r < dense;
+                d += r * scale;
+                scale *= dense;
+            }
+            return low ? d : npos;
+        }
+
+        size_t home(const size_t& i) const {
+            return ((i * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+        }
+
+        struct slot {
+            uint32_t key; // the index + 1, or 0 if empty
+            float value;
+        };
+        static constexpr size_t npos = size_t(-1);
+
+        size_t radix, digits, dense;
+        uint64_t magic[9];
+        int shift[9];
+        size_t mask;
+        size_t used;
+        bool full = false;
+        slot* slots;
+        std::shared_ptr<void> holder;
+    };
+
+    weight(float* value, const size_t& len, const std::shared_ptr<void>& holder, const std::shared_ptr<hashed>& tail = nullptr)
+        : length(len), value(value), holder(holder), tail(tail) {}
+
+    static size_t power(const size_t& base, const size_t& exp) {
+        return exp == 0 ? 1 : base * power(base, exp - 1);
+    }
+
+    /**
+     * map a zeroed table from anonymous memory, so that the kernel zeroes its pages on first touch instead of upfront
+     * explicit huge pages are taken if reserved (see /proc/sys/vm/nr_hugepages), otherwise transparent ones are requested,
+     * since the random accesses of a table would miss the TLB on almost every 4 KiB page
+     */
     static float* alloc(size_t num) {
-        static size_t total = 0;
-        static size_t limit = (2 << 30) / sizeof(float); // 2G memory
-        try {
-            total += num;
-            if (total > limit) throw std::bad_alloc();
-            return new float[num]();
-        } catch (std::bad_alloc&) {
-            std::cerr << "memory limit exceeded" << std::endl;
+        size_t bytes = span(num);
+        size_t total = allocated() += bytes;
+        if (total > budget()) {
+            std::cerr << "memory limit exceeded: " << (total >> 20) << " MiB of weights in "
+                      << (budget() >> 20) << " MiB of memory" << std::endl;
             std::exit(-1);
         }
-        return nullptr;
+        void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED) {
+            // over-map by a huge page to align the table, so that all of it can be backed by huge pages
+            size_t align = huge_page;
+            char* base = static_cast<char*>(mmap(nullptr, bytes + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (base == MAP_FAILED) {
+                std::cerr << "cannot allocate " << (bytes >> 20) << " MiB of weights" << std::endl;
+                std::exit(-1);
+            }
+            char* head = base + (align - reinterpret_cast<uintptr_t>(base) % align) % align;
+            if (head != base) munmap(base, head - base);
+            if (head + bytes != base + bytes + align) munmap(head + bytes, base + bytes + align - (head + bytes));
+            madvise(head, bytes, MADV_HUGEPAGE);
+            addr = head;
+        }
+        return static_cast<float*>(addr);
+    }
+
+    static std::shared_ptr<void> own(float* value, const size_t& num) {
+        size_t bytes = span(num);
+        return std::shared_ptr<void>(value, [bytes](float* p) { munmap(p, bytes); allocated() -= bytes; });
+    }
+
+    /**
+     * the bytes of weights currently mapped by alloc, checked against the budget
+     */
+    static std::atomic<size_t>& allocated() {
+        static std::atomic<size_t> total(0);
+        return total;
+    }
+
+    /**
+     * the size of a table rounded up to whole huge pages, which also keeps MAP_HUGETLB mappings valid
+     */
+    static size_t span(const size_t& num) {
+        return std::max<size_t>((num * sizeof(float) + huge_page - 1) / huge_page, 1) * huge_page;
+    }
+
+    /**
+     * the physical memory of the machine, which all weight tables together should fit in
+     */
+    static size_t budget() {
+        return size_t(sysconf(_SC_PHYS_PAGES)) * size_t(sysconf(_SC_PAGESIZE));
     }
 
+    static constexpr size_t huge_page = 2 << 20;
+
     size_t length;
-    float* value;
+    float* value; // the dense region only, for a sparse table
+    std::shared_ptr<void> holder; // keeps the storage alive, shared with views
+    std::shared_ptr<hashed> tail; // the sparse part, or null for a dense table
+};
+
+/**
+ * quantized weight table for inference, 16-bit fixed point with a per-table scale
+ * half the memory and bandwidth of weight; copies share the same storage
+ * the tables come from weight::alloc as well, i.e., huge pages within the same memory budget
+ */
+class qweight {
+public:
+    qweight() : length(0), scale(0), value(nullptr) {}
+    qweight(const weight& w) : length(w.size()), scale(0), value(nullptr) {
+        float range = 0;
+        for (size_t i = 0; i < length; i++)
+            range = std::max(range, std::abs(w.load(i)));
+        scale = range > 0 ? range / 32767 : 1;
+        size_t num = (length + 1) / 2; // in floats, as weight::alloc counts
+        value = reinterpret_cast<int16_t*>(weight::alloc(num));
+        holder = weight::own(reinterpret_cast<float*>(value), num);
+        for (size_t i = 0; i < length; i++)
+            value[i] = int16_t(std::lrint(w.load(i) / scale));
+    }
+
+    float operator[] (const size_t& i) const { return value[i] * scale; }
+    void prefetch(const size_t& i) const { __builtin_prefetch(value + i); }
+    size_t size() const { return length; }
+
+private:
+    size_t length;
+    float scale;
+    int16_t* value;
+    std::shared_ptr<void> holder;
+};
+
+/**
+ * periodic snapshots of weight tables, written without stalling training
+ * a snapshot forks the process, so that the child sees the tables frozen at that moment by copy-on-write,
+ * writes them aside and renames the file into place, while a background thread of the parent waits for it
+ * training pauses only for the fork itself; a snapshot which falls due while another is being written is deferred,
+ * i.e., taken at the first episode closed after the child exits, and the next one is due counting from then
+ * the child writes by 'dump', which must not allocate, e.g., weight::dump or codec::write by one thread
+ */
+class checkpoint {
+public:
+    typedef std::function<bool(const int&, const std::vector<weight>&)> writer;
+
+    checkpoint(const std::string& path, const size_t& every, const double& period, const writer& dump = weight::dump)
+        : path(path), temp(path + ".ckpt"), every(every), period(period), dump(dump), episodes(0), next(every),
+          last(std::chrono::steady_clock::now()), busy(false) {}
+    checkpoint(const checkpoint&) = delete;
+    checkpoint& operator =(const checkpoint&) = delete;
+    ~checkpoint() { wait(); }
+
+    /**
+     * count a closed episode, and take a snapshot of 'tables' if one is due
+     */
+    void close_episode(const std::vector<weight>& tables) {
+        size_t n = ++episodes;
+        if (busy) return;
+        std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+        if (!guard.owns_lock() || busy) return;
+        auto now = std::chrono::steady_clock::now();
+        bool due = (every && n >= next) || (period > 0 && std::chrono::duration<double>(now - last).count() >= period);
+        if (!due) return;
+        next = n + every;
+        last = now;
+        if (waiter.joinable()) waiter.join();
+
+        busy = true;
+        pid_t pid = fork();
+        if (pid == 0) {
+            int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool ok = fd != -1 && dump(fd, tables);
+            ok = fd != -1 && close(fd) == 0 && ok;
+            _exit(ok && rename(temp.c_str(), path.c_str()) == 0 ? 0 : 1);
+        } else if (pid == -1) {
+            busy = false;
+            std::cerr << "cannot fork for checkpoint" << std::endl;
+            return;
+        }
+        waiter = std::thread([this, pid]() {
+            int status = 0;
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                std::cerr << "cannot write checkpoint " << path << std::endl;
+            busy = false;
+        });
+    }
+
+    /**
+     * wait for the snapshot being written, if any
+     */
+    void wait() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (waiter.joinable()) waiter.join();
+    }
+
+private:
+    std::string path, temp;
+    size_t every;
+    double period;
+    writer dump;
+    std::atomic<size_t> episodes;
+    size_t next;
+    std::chrono::steady_clock::time_point last;
+    std::mutex lock;
+    std::thread waiter;
+    std::atomic<bool> busy;
 };